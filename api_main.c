@@ -0,0 +1,849 @@
+// Checks the opt-only interface in opt_malloc.h, and what the collatz
+// programs don't show: batches, regions, remote frees, xrealloc, heaps
+// of exited threads, the large span cache, pools, aligned blocks,
+// xcalloc, sized frees, stats, xmalloc_trim, the background purger and
+// fork().
+//
+//   api-opt [percpu]
+//
+// With percpu, it all runs with the per-CPU caches on (OPT_PERCPU=1), and
+// checks they hand blocks from thread to thread. Prints "api test ok", or
+// what failed and exits 1.
+
+#define _GNU_SOURCE // for sched_getcpu
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sched.h>
+#include <sys/wait.h>
+#if defined(__linux__) && defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define HAVE_RSEQ 1
+#endif
+
+#include "opt_malloc.h"
+
+#define MB (1024 * 1024)
+
+#define check(cond, ...) do { \
+    if (!(cond)) { \
+        printf("api test failed: " __VA_ARGS__); \
+        printf("\n"); \
+        exit(1); \
+    } \
+} while (0)
+
+static
+long
+rss_bytes()
+{
+    long size = 0;
+    long pages = 0;
+    FILE* fh = fopen("/proc/self/statm", "r");
+    if (fh != NULL) {
+        if (fscanf(fh, "%ld %ld", &size, &pages) != 2) {
+            pages = 0;
+        }
+        fclose(fh);
+    }
+    return pages * 4096;
+}
+
+static
+void
+sleep_ms(long ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000 };
+    nanosleep(&ts, NULL);
+}
+
+static
+void
+fill(void* item, size_t size, int seed)
+{
+    memset(item, seed & 0xff, size);
+}
+
+static
+int
+filled(void* item, size_t size, int seed)
+{
+    unsigned char* bytes = item;
+    return size == 0 || (bytes[0] == (seed & 0xff) && bytes[size - 1] == (seed & 0xff));
+}
+
+#define BATCH 500
+
+// Blocks from xmalloc_batch are usable for the size asked for, distinct,
+// and can go back through xfree_batch, xfree or another thread.
+static
+void*
+batch_free_thread(void* arg)
+{
+    xfree_batch((void**)arg, BATCH);
+    return NULL;
+}
+
+static
+void
+test_batch()
+{
+    static const size_t sizes[] = { 1, 16, 100, 1000, 2048, 3000, 20000, 100000 };
+    void* items[BATCH];
+
+    opt_stats before;
+    xmalloc_get_stats(&before);
+
+    for (size_t ss = 0; ss < sizeof(sizes) / sizeof(sizes[0]); ++ss) {
+        size_t size = sizes[ss];
+        xmalloc_batch(size, BATCH, items);
+        for (int ii = 0; ii < BATCH; ++ii) {
+            check(items[ii] != NULL, "batch of %zu: NULL", size);
+            check((uintptr_t)items[ii] % 16 == 0, "batch of %zu: misaligned", size);
+            check(xmalloc_usable_size(items[ii]) >= size, "batch of %zu: usable size %zu",
+                  size, xmalloc_usable_size(items[ii]));
+            fill(items[ii], size, ii);
+        }
+        for (int ii = 0; ii < BATCH; ++ii) {
+            check(filled(items[ii], size, ii), "batch of %zu: blocks overlap", size);
+        }
+
+        // Some go back one by one, the rest as a batch (NULLs are skipped).
+        for (int ii = 0; ii < BATCH; ii += 3) {
+            xfree(items[ii]);
+            items[ii] = NULL;
+        }
+        xfree_batch(items, BATCH);
+    }
+
+    // Freed by a thread that doesn't own them.
+    xmalloc_batch(64, BATCH, items);
+    pthread_t thread;
+    pthread_create(&thread, NULL, batch_free_thread, items);
+    pthread_join(thread, NULL);
+
+    opt_stats after;
+    xmalloc_get_stats(&after);
+    check(after.allocs - before.allocs == after.frees - before.frees,
+          "batch: %ld allocs but %ld frees", after.allocs - before.allocs,
+          after.frees - before.frees);
+}
+
+// A region's memory is aligned and its own, and all of it goes at once.
+static
+void
+test_region()
+{
+    opt_stats before;
+    xmalloc_get_stats(&before);
+
+    xregion* rr = xregion_create();
+    char* first = xregion_alloc(rr, 10);
+    fill(first, 10, 1);
+
+    size_t total = 0;
+    for (int ii = 0; total < 32 * MB; ++ii) {
+        size_t size = ii % 100 == 0 ? 40000 : 1 + ii % 500;
+        void* item = xregion_alloc(rr, size);
+        check((uintptr_t)item % 16 == 0, "region: misaligned");
+        fill(item, size, 2);
+        total += size;
+    }
+    check(filled(first, 10, 1), "region: first allocation overwritten");
+
+    opt_stats during;
+    xmalloc_get_stats(&during);
+    check(during.bytes_mapped - before.bytes_mapped >= 32 * MB,
+          "region: only %ld bytes mapped for 32MB", during.bytes_mapped - before.bytes_mapped);
+
+    // At most the large span cache (4MB) keeps any of it.
+    xregion_destroy(rr);
+    opt_stats after;
+    xmalloc_get_stats(&after);
+    check(after.bytes_mapped - before.bytes_mapped <= 5 * MB,
+          "region: %ld bytes still mapped after destroy", after.bytes_mapped - before.bytes_mapped);
+}
+
+#define REMOTE_BLOCKS 10000
+
+static void* remote_items[REMOTE_BLOCKS];
+
+static
+void*
+remote_free_thread(void* arg)
+{
+    for (int ii = 0; ii < REMOTE_BLOCKS; ++ii) {
+        check(filled(remote_items[ii], ii % 2 ? 3000 : 100, ii), "remote: block changed hands");
+        xfree(remote_items[ii]);
+    }
+    return NULL;
+}
+
+// Blocks freed by another thread come back to the thread that made them,
+// which reuses them instead of carving more.
+static
+void
+test_remote()
+{
+    opt_stats before;
+    for (int round = 0; round < 3; ++round) {
+        if (round == 1) {
+            xmalloc_get_stats(&before);
+        }
+        for (int ii = 0; ii < REMOTE_BLOCKS; ++ii) {
+            remote_items[ii] = xmalloc(ii % 2 ? 3000 : 100);
+            fill(remote_items[ii], ii % 2 ? 3000 : 100, ii);
+        }
+        pthread_t thread;
+        pthread_create(&thread, NULL, remote_free_thread, NULL);
+        pthread_join(thread, NULL);
+    }
+
+    opt_stats after;
+    xmalloc_get_stats(&after);
+    check(after.allocs - before.allocs == after.frees - before.frees,
+          "remote: %ld allocs but %ld frees", after.allocs - before.allocs, after.frees - before.frees);
+    check(after.bytes_in_use == before.bytes_in_use, "remote: %ld bytes still in use",
+          after.bytes_in_use - before.bytes_in_use);
+    check(after.pages_carved == before.pages_carved, "remote: carved %ld more pages",
+          after.pages_carved - before.pages_carved);
+}
+
+// A large block grows by moving its pages (mremap) rather than copying,
+// keeping what it had, and shrinks in place, handing its tail back.
+static
+void
+test_realloc()
+{
+    opt_stats before;
+    xmalloc_get_stats(&before);
+
+    size_t size = 100000;
+    char* item = xmalloc(size);
+    fill(item, size, 1);
+    while (size < 32 * MB) {
+        item = xrealloc(item, 2 * size);
+        check(item != NULL && filled(item, size, 1), "realloc: %zu to %zu lost the contents", size, 2 * size);
+        size *= 2;
+        fill(item, size, 1);
+    }
+
+    opt_stats grown;
+    xmalloc_get_stats(&grown);
+    long mapped = grown.bytes_mapped - before.bytes_mapped;
+    check(mapped >= (long)size && mapped <= (long)size + 5 * MB, "realloc: %ld bytes mapped for %zu",
+          mapped, size);
+
+    char* shrunk = xrealloc(item, 20000);
+    check(shrunk == item && filled(shrunk, 20000, 1), "realloc: shrinking moved the block");
+    opt_stats after;
+    xmalloc_get_stats(&after);
+    check(grown.bytes_mapped - after.bytes_mapped >= (long)size - MB,
+          "realloc: shrinking gave back %ld bytes", grown.bytes_mapped - after.bytes_mapped);
+    xfree(shrunk);
+}
+
+#define ORPHAN_BLOCKS 20000
+#define ORPHAN_KEPT 100 // every this many blocks outlives its thread
+
+static void* orphan_items[ORPHAN_BLOCKS];
+
+static
+size_t
+orphan_size(int ii)
+{
+    return ii % 10 == 0 ? 5000 : 16 + ii % 64 * 16;
+}
+
+// Leaves some blocks behind, and its heap with the rest free.
+static
+void*
+orphan_thread(void* arg)
+{
+    for (int ii = 0; ii < ORPHAN_BLOCKS; ++ii) {
+        orphan_items[ii] = xmalloc(orphan_size(ii));
+        fill(orphan_items[ii], orphan_size(ii), ii);
+    }
+    for (int ii = 0; ii < ORPHAN_BLOCKS; ++ii) {
+        if (ii % ORPHAN_KEPT != 0) {
+            xfree(orphan_items[ii]);
+        }
+    }
+    return NULL;
+}
+
+// Needs less than the last thread left free.
+static
+void*
+adopt_thread(void* arg)
+{
+    void** items = arg;
+    for (int ii = 0; ii < ORPHAN_BLOCKS / 2; ++ii) {
+        items[ii] = xmalloc(orphan_size(ii));
+        fill(items[ii], orphan_size(ii), ii);
+    }
+    for (int ii = 0; ii < ORPHAN_BLOCKS / 2; ++ii) {
+        xfree(items[ii]);
+    }
+    return NULL;
+}
+
+// A new thread takes over the heap of the last one to exit, free blocks
+// and all, rather than carving its own; the blocks left behind can still
+// be freed from anywhere.
+static
+void
+test_orphans()
+{
+    static void* items[ORPHAN_BLOCKS / 2];
+    pthread_t thread;
+    pthread_create(&thread, NULL, orphan_thread, NULL);
+    pthread_join(thread, NULL);
+
+    opt_stats before;
+    xmalloc_get_stats(&before);
+    pthread_create(&thread, NULL, adopt_thread, items);
+    pthread_join(thread, NULL);
+    opt_stats after;
+    xmalloc_get_stats(&after);
+    check(after.chunks_reserved == before.chunks_reserved && after.pages_carved == before.pages_carved,
+          "orphans: the next thread reserved %ld chunks and carved %ld pages",
+          after.chunks_reserved - before.chunks_reserved, after.pages_carved - before.pages_carved);
+
+    for (int ii = 0; ii < ORPHAN_BLOCKS; ii += ORPHAN_KEPT) {
+        check(filled(orphan_items[ii], orphan_size(ii), ii), "orphans: a block left behind changed");
+        xfree(orphan_items[ii]);
+    }
+}
+
+#define PERCPU_DRAIN 64 // more than a CPU's cache holds of a class
+
+static volatile int percpu_freed;
+static volatile int percpu_done;
+static void* percpu_block;
+
+static
+void
+pin_to(int cpu)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static
+void*
+percpu_thread(void* arg)
+{
+    pin_to(*(int*)arg);
+    percpu_block = xmalloc(64);
+    xfree(percpu_block);
+    percpu_freed = 1;
+    while (!percpu_done) {
+        sched_yield();
+    }
+    return NULL;
+}
+
+// A block freed on a CPU is the next one allocated there, by any thread:
+// the freeing thread is still alive, so its magazines can't have it.
+static
+void
+test_percpu()
+{
+#ifdef HAVE_RSEQ
+    int cpu = sched_getcpu();
+    if (__rseq_size == 0 || cpu < 0) {
+        printf("percpu: no rseq, skipped\n");
+        return;
+    }
+
+    cpu_set_t saved;
+    pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved);
+    pin_to(cpu);
+
+    // Empty this CPU's cache of the class, so the other thread's free fits.
+    void* drained[PERCPU_DRAIN];
+    for (int ii = 0; ii < PERCPU_DRAIN; ++ii) {
+        drained[ii] = xmalloc(64);
+    }
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, percpu_thread, &cpu);
+    while (!percpu_freed) {
+        sched_yield();
+    }
+    void* item = xmalloc(64);
+    percpu_done = 1;
+    pthread_join(thread, NULL);
+    check(item == percpu_block, "percpu: got %p, not the %p freed on this CPU", item, percpu_block);
+
+    xfree(item);
+    for (int ii = 0; ii < PERCPU_DRAIN; ++ii) {
+        xfree(drained[ii]);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
+#else
+    printf("percpu: no rseq, skipped\n");
+#endif
+}
+
+#define LARGE_BLOCKS 8
+
+// Freed large blocks are kept for reuse up to the cap, and lowering the
+// cap unmaps what's over it.
+static
+void
+test_large_cache()
+{
+    void* large[LARGE_BLOCKS];
+    xmalloc_set_large_cache_limit(0);
+    xmalloc_set_large_cache_limit(MB);
+
+    opt_stats before;
+    xmalloc_get_stats(&before);
+    for (int ii = 0; ii < LARGE_BLOCKS; ++ii) {
+        large[ii] = xmalloc(500 * 1024);
+        fill(large[ii], 500 * 1024, ii);
+    }
+    for (int ii = 0; ii < LARGE_BLOCKS; ++ii) {
+        xfree(large[ii]);
+    }
+    opt_stats after;
+    xmalloc_get_stats(&after);
+    long kept = after.bytes_mapped - before.bytes_mapped;
+    check(kept > 0 && kept <= MB, "large cache: %ld bytes kept under a 1MB cap", kept);
+
+    // Reused without mapping more.
+    void* item = xmalloc(500 * 1024);
+    opt_stats reused;
+    xmalloc_get_stats(&reused);
+    check(reused.pages_mapped == after.pages_mapped, "large cache: mapped %ld pages with some cached",
+          reused.pages_mapped - after.pages_mapped);
+    xfree(item);
+
+    xmalloc_set_large_cache_limit(0);
+    xmalloc_get_stats(&after);
+    check(after.bytes_mapped == before.bytes_mapped, "large cache: %ld bytes kept under a 0 cap",
+          after.bytes_mapped - before.bytes_mapped);
+    xmalloc_set_large_cache_limit(4 * MB);
+}
+
+#define POOL_OBJECTS 10000
+
+// Freed objects are handed out again before the pool grows, and the stats
+// add up.
+static
+void
+test_pool()
+{
+    static void* items[POOL_OBJECTS];
+    xpool* pp = xpool_create(40, 16);
+    check(pp != NULL, "pool: create failed");
+
+    for (int ii = 0; ii < POOL_OBJECTS; ++ii) {
+        items[ii] = xpool_alloc(pp);
+        check((uintptr_t)items[ii] % 16 == 0, "pool: misaligned");
+        fill(items[ii], 40, ii);
+    }
+    for (int ii = 0; ii < POOL_OBJECTS; ++ii) {
+        check(filled(items[ii], 40, ii), "pool: objects overlap");
+    }
+
+    xpool_stats st;
+    xpool_get_stats(pp, &st);
+    check(st.obj_size == 40 && st.stride == 48, "pool: size %zu stride %zu", st.obj_size, st.stride);
+    check(st.in_use == POOL_OBJECTS, "pool: %ld in use", st.in_use);
+    check(st.capacity == st.in_use + st.cached + st.free, "pool: %ld capacity, %ld + %ld + %ld",
+          st.capacity, st.in_use, st.cached, st.free);
+    long slabs = st.slabs;
+
+    for (int ii = 0; ii < POOL_OBJECTS; ++ii) {
+        xpool_free(pp, items[ii]);
+    }
+    xpool_get_stats(pp, &st);
+    check(st.in_use == 0, "pool: %ld in use after freeing all", st.in_use);
+
+    for (int ii = 0; ii < POOL_OBJECTS; ++ii) {
+        items[ii] = xpool_alloc(pp);
+    }
+    xpool_get_stats(pp, &st);
+    check(st.slabs == slabs, "pool: grew from %ld to %ld slabs on reuse", slabs, st.slabs);
+    for (int ii = 0; ii < POOL_OBJECTS; ++ii) {
+        xpool_free(pp, items[ii]);
+    }
+
+    // The table of pools is finite.
+    int made = 1;
+    while (xpool_create(16, 16) != NULL) {
+        made += 1;
+        check(made <= 1000, "pool: xpool_create never fails");
+    }
+}
+
+// Aligned blocks of every kind are aligned, hold what was asked for, and
+// large ones aligned to less than a page take no extra page.
+static
+void
+test_aligned()
+{
+    static const size_t aligns[] = { 16, 32, 64, 256, 1024, 4096, 65536 };
+    static const size_t sizes[] = { 0, 1, 48, 100, 2000, 5000, 20000, 100000, 1000000 };
+
+    for (size_t aa = 0; aa < sizeof(aligns) / sizeof(aligns[0]); ++aa) {
+        for (size_t ss = 0; ss < sizeof(sizes) / sizeof(sizes[0]); ++ss) {
+            size_t align = aligns[aa];
+            size_t size = sizes[ss];
+
+            opt_stats before;
+            xmalloc_get_stats(&before);
+            void* item = xmalloc_aligned(align, size);
+            opt_stats after;
+            xmalloc_get_stats(&after);
+
+            check(item != NULL && (uintptr_t)item % align == 0, "aligned(%zu, %zu): %p",
+                  align, size, item);
+            // Even an empty block has a byte, so it's inside its own pages.
+            check(xmalloc_usable_size(item) >= (size > 0 ? size : 1), "aligned(%zu, %zu): usable size %zu",
+                  align, size, xmalloc_usable_size(item));
+            fill(item, size, 9);
+
+            long used = after.bytes_in_use - before.bytes_in_use;
+            size_t pages = (size + align + 4095) / 4096 * 4096;
+            check(size < 20000 || align >= 4096 || used <= (long)pages,
+                  "aligned(%zu, %zu): %ld bytes for %zu", align, size, used, pages);
+            xfree(item);
+        }
+    }
+}
+
+// xcalloc's blocks are all zero, reused ones (small, medium, and large
+// from the span cache) included.
+static
+void
+test_calloc()
+{
+    static const size_t sizes[] = { 1, 100, 2048, 3000, 15000, 20000, 600000, 3 * MB };
+
+    for (size_t ss = 0; ss < sizeof(sizes) / sizeof(sizes[0]); ++ss) {
+        size_t size = sizes[ss];
+        for (int round = 0; round < 3; ++round) {
+            unsigned char* item = xcalloc(size, 1);
+            check(item != NULL, "calloc(%zu): NULL", size);
+            for (size_t ii = 0; ii < size; ++ii) {
+                check(item[ii] == 0, "calloc(%zu): byte %zu is %d", size, ii, item[ii]);
+            }
+            memset(item, 0xff, size);
+            xfree(item);
+        }
+    }
+}
+
+#define SIZED_BLOCKS 100
+
+// Sized frees, aligned ones included, put blocks back where they came
+// from: every byte handed out comes back, and the blocks are reused.
+static
+void
+test_sized()
+{
+    static const size_t aligns[] = { 16, 32, 64, 256, 1024, 4096, 65536 };
+    static const size_t sizes[] = { 0, 16, 17, 100, 1000, 2048, 3000, 10000, 20000, 100000 };
+    void* items[SIZED_BLOCKS];
+
+    for (size_t aa = 0; aa < sizeof(aligns) / sizeof(aligns[0]); ++aa) {
+        for (size_t ss = 0; ss < sizeof(sizes) / sizeof(sizes[0]); ++ss) {
+            size_t align = aligns[aa];
+            size_t size = sizes[ss];
+
+            opt_stats before;
+            xmalloc_get_stats(&before);
+            for (int round = 0; round < 3; ++round) {
+                for (int ii = 0; ii < SIZED_BLOCKS; ++ii) {
+                    items[ii] = align == 16 ? xmalloc(size) : xmalloc_aligned(align, size);
+                    check(items[ii] != NULL && (uintptr_t)items[ii] % align == 0,
+                          "sized(%zu, %zu): %p", align, size, items[ii]);
+                    fill(items[ii], size, ii);
+                }
+                for (int ii = 0; ii < SIZED_BLOCKS; ++ii) {
+                    check(filled(items[ii], size, ii), "sized(%zu, %zu): blocks overlap", align, size);
+                    if (align == 16) {
+                        xfree_sized(items[ii], size);
+                    }
+                    else {
+                        xfree_aligned_sized(items[ii], align, size);
+                    }
+                }
+            }
+            opt_stats after;
+            xmalloc_get_stats(&after);
+
+            check(after.frees - before.frees == 3 * SIZED_BLOCKS, "sized(%zu, %zu): %ld frees",
+                  align, size, after.frees - before.frees);
+            check(after.bytes_in_use == before.bytes_in_use, "sized(%zu, %zu): %ld bytes still in use",
+                  align, size, after.bytes_in_use - before.bytes_in_use);
+        }
+    }
+
+    // A small block realloced within its class is freed by its new size.
+    char* item = xmalloc_aligned(32, 16);
+    item = xrealloc(item, 30);
+    xfree_sized(item, 30);
+}
+
+#define STATS_THREADS 4
+#define STATS_BLOCKS 20000
+
+static void* stats_items[STATS_THREADS][STATS_BLOCKS];
+
+static
+void*
+stats_thread(void* arg)
+{
+    void** items = arg;
+    for (int ii = 0; ii < STATS_BLOCKS; ++ii) {
+        items[ii] = xmalloc(16 + ii % 128 * 16);
+    }
+    for (int ii = 0; ii < STATS_BLOCKS; ++ii) {
+        xfree(items[ii]);
+    }
+    return NULL;
+}
+
+// The totals add up across threads, and can be read while they run.
+static
+void
+test_stats()
+{
+    opt_stats before;
+    xmalloc_get_stats(&before);
+
+    pthread_t threads[STATS_THREADS];
+    for (int tt = 0; tt < STATS_THREADS; ++tt) {
+        pthread_create(&threads[tt], NULL, stats_thread, stats_items[tt]);
+    }
+    opt_stats during;
+    for (int ii = 0; ii < 1000; ++ii) {
+        xmalloc_get_stats(&during);
+        check(during.free_blocks >= during.magazine_blocks + during.depot_blocks,
+              "stats: %ld free blocks, %ld of them in magazines and %ld in the depot",
+              during.free_blocks, during.magazine_blocks, during.depot_blocks);
+    }
+    for (int tt = 0; tt < STATS_THREADS; ++tt) {
+        pthread_join(threads[tt], NULL);
+    }
+
+    opt_stats after;
+    xmalloc_get_stats(&after);
+    long blocks = STATS_THREADS * STATS_BLOCKS;
+    long class_allocs = 0;
+    long class_frees = 0;
+    for (int ii = 0; ii < OPT_NUM_CLASSES; ++ii) {
+        class_allocs += after.class_allocs[ii] - before.class_allocs[ii];
+        class_frees += after.class_frees[ii] - before.class_frees[ii];
+    }
+    check(after.allocs - before.allocs == blocks, "stats: %ld allocs for %ld",
+          after.allocs - before.allocs, blocks);
+    check(after.frees - before.frees == blocks, "stats: %ld frees for %ld",
+          after.frees - before.frees, blocks);
+    check(class_allocs == blocks && class_frees == blocks, "stats: %ld class allocs and %ld frees for %ld",
+          class_allocs, class_frees, blocks);
+    check(after.bytes_in_use == before.bytes_in_use, "stats: %ld bytes still in use",
+          after.bytes_in_use - before.bytes_in_use);
+}
+
+#define FILL_BLOCKS 200000
+
+static void* blocks[FILL_BLOCKS];
+
+// About 64MB of small and medium blocks, touched and then freed.
+static
+void
+fill_and_free(int seed)
+{
+    for (int ii = 0; ii < FILL_BLOCKS; ++ii) {
+        size_t size = 16 + (ii * seed) % 40 * 16 + (ii % 50 == 0 ? 3000 + ii % 9000 : 0);
+        blocks[ii] = xmalloc(size);
+        fill(blocks[ii], size, ii);
+    }
+    for (int ii = 0; ii < FILL_BLOCKS; ++ii) {
+        xfree(blocks[ii]);
+    }
+}
+
+static
+void*
+fill_thread(void* arg)
+{
+    fill_and_free(7);
+    return NULL;
+}
+
+// Slabs emptied by frees are given back as they go (unless OPT_PURGE=0),
+// and what xmalloc_trim says it gave back should show up in RSS.
+static
+void
+test_trim()
+{
+    const char* purge = getenv("OPT_PURGE");
+    opt_stats before;
+    xmalloc_get_stats(&before);
+    fill_and_free(3);
+    opt_stats after;
+    xmalloc_get_stats(&after);
+    check(after.pages_purged - before.pages_purged >= 8 * MB / 4096 || (purge != NULL && atoi(purge) == 0),
+          "trim: frees gave back only %ld pages", after.pages_purged - before.pages_purged);
+
+    long rss0 = rss_bytes();
+    size_t trimmed = xmalloc_trim();
+    long rss1 = rss_bytes();
+    long drop = rss0 - rss1;
+
+    check(trimmed > 8 * MB, "trim: only %zu bytes trimmed", trimmed);
+    check(drop > 0 && drop <= (long)trimmed + MB, "trim: said %zu, RSS went down %ld",
+          trimmed, drop);
+    check(drop >= (long)trimmed / 2, "trim: said %zu, RSS only went down %ld", trimmed, drop);
+}
+
+// Slabs an exited thread left behind, and cached large spans, are given
+// back over the decay time. With OPT_PURGE=0 a thread's slabs aren't
+// swept as it exits, which leaves the purger only the large spans.
+static
+void
+test_purger()
+{
+    const char* purge = getenv("OPT_PURGE");
+    int sweeps = purge == NULL || atoi(purge) != 0;
+
+    xmalloc_set_large_cache_limit(4 * MB);
+    check(xmalloc_start_purger(100) == 0, "purger: didn't start");
+
+    pthread_t thread;
+    pthread_create(&thread, NULL, fill_thread, NULL);
+    pthread_join(thread, NULL);
+
+    void* large[4];
+    for (int ii = 0; ii < 4; ++ii) {
+        large[ii] = xmalloc(512 * 1024);
+        fill(large[ii], 512 * 1024, ii);
+    }
+    for (int ii = 0; ii < 4; ++ii) {
+        xfree(large[ii]);
+    }
+    long rss0 = rss_bytes();
+
+    opt_stats st;
+    for (int ii = 0; ii < 100; ++ii) {
+        sleep_ms(50);
+        xmalloc_get_stats(&st);
+        if (st.dirty_slabs == 0 && (st.purger_pages > 0 || !sweeps) && st.purger_bytes_unmapped >= 2 * MB) {
+            break;
+        }
+    }
+    long rss1 = rss_bytes();
+    long given = st.purger_pages * 4096 + st.purger_bytes_unmapped;
+
+    check(st.purger_passes > 0, "purger: never ran");
+    check(st.dirty_slabs == 0, "purger: %ld slabs still dirty", st.dirty_slabs);
+    check(st.purger_pages > 0 || !sweeps, "purger: gave no slabs back");
+    check(st.purger_bytes_unmapped >= 2 * MB, "purger: unmapped %ld bytes of large spans",
+          st.purger_bytes_unmapped);
+    check(rss0 - rss1 >= given / 2, "purger: gave back %ld bytes, RSS went down %ld",
+          given, rss0 - rss1);
+}
+
+#define CHURN_BLOCKS 20000
+#define FORKS 5
+
+static volatile int churning;
+
+// Fills and empties slabs, which takes its heap's slab lock.
+static
+void*
+churn_thread(void* arg)
+{
+    static void* items[CHURN_BLOCKS];
+    while (churning) {
+        for (int ii = 0; ii < CHURN_BLOCKS; ++ii) {
+            items[ii] = xmalloc(16 + ii % 64 * 16);
+        }
+        for (int ii = 0; ii < CHURN_BLOCKS; ++ii) {
+            xfree(items[ii]);
+        }
+    }
+    return NULL;
+}
+
+// A child forked while other threads are busy has no locks left held (a
+// purger pass locks every heap), and a purger of its own.
+static
+void
+test_fork()
+{
+    churning = 1;
+    pthread_t thread;
+    pthread_create(&thread, NULL, churn_thread, NULL);
+
+    for (int ff = 0; ff < FORKS; ++ff) {
+        sleep_ms(20);
+        pid_t pid = fork();
+        if (pid == 0) {
+            alarm(10);
+            opt_stats st;
+            xmalloc_get_stats(&st);
+            long passes = st.purger_passes;
+            for (int ii = 0; ii < 100 && st.purger_passes <= passes; ++ii) {
+                void* item = xmalloc(100);
+                xfree(item);
+                sleep_ms(20);
+                xmalloc_get_stats(&st);
+            }
+            _exit(st.purger_passes > passes ? 0 : 1);
+        }
+
+        int status = 0;
+        waitpid(pid, &status, 0);
+        check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "fork: child %s",
+              WIFEXITED(status) ? "had no purger" : "hung");
+    }
+
+    churning = 0;
+    pthread_join(thread, NULL);
+}
+
+int
+main(int argc, char* argv[])
+{
+    // Before the first allocation, which reads it.
+    int percpu = argc > 1 && strcmp(argv[1], "percpu") == 0;
+    if (percpu) {
+        setenv("OPT_PERCPU", "1", 1);
+    }
+
+    test_batch();
+    test_region();
+    test_remote();
+    if (percpu) {
+        test_percpu();
+    }
+    test_realloc();
+    test_orphans();
+    test_large_cache();
+    test_pool();
+    test_aligned();
+    test_calloc();
+    test_sized();
+    test_stats();
+    test_trim();
+    // Last: the purger can't be stopped, and would race with the trim.
+    test_purger();
+    test_fork();
+
+    printf("api test ok\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+#!/usr/bin/perl
+use 5.16.0;
+use warnings FATAL => 'all';
+
+use Getopt::Long;
+use JSON::PP;
+
+# Runs bench-ALLOC (see bench_main.c) for every allocator, workload and
+# thread count, and writes one row per run with throughput and scaling
+# efficiency relative to the smallest thread count of that series.
+#
+#   perl bench.pl [--allocs sys,opt,tlsf] [--workloads ivec,list]
+#                 [--threads 1,2,4 | --max-threads N] [--top N]
+#                 [--reps N] [--json] [--out FILE]
+#
+# hwx isn't in the default set: its single free list is too slow to
+# finish a sweep at a useful TOP.
+
+my $allocs = "sys,opt,tlsf";
+my $workloads = "ivec,list";
+my $threads = "";
+my $max_threads = 0 + `nproc`;
+my $top = 50000;
+my $reps = 1;
+my $json = 0;
+my $out = "";
+
+GetOptions(
+    "allocs=s"      => \$allocs,
+    "workloads=s"   => \$workloads,
+    "threads=s"     => \$threads,
+    "max-threads=i" => \$max_threads,
+    "top=i"         => \$top,
+    "reps=i"        => \$reps,
+    "json"          => \$json,
+    "out=s"         => \$out,
+) or die "bad arguments\n";
+
+my @counts = $threads ne "" ? split(/,/, $threads) : (1..$max_threads);
+@counts = sort { $a <=> $b } @counts;
+
+# Best of $reps runs.
+sub run_bench {
+    my ($alloc, $workload, $nthreads) = @_;
+    my $best;
+    for (1..$reps) {
+        my $line = `./bench-$alloc $workload $top $nthreads`;
+        die "bench-$alloc $workload $top $nthreads failed\n" if $? != 0;
+        chomp $line;
+        my (undef, undef, undef, $secs, $ops) = split(/,/, $line);
+        if (!defined($best) || $secs < $best->{seconds}) {
+            $best = { seconds => 0 + $secs, ops => 0 + $ops };
+        }
+    }
+    return $best;
+}
+
+my @rows;
+for my $alloc (split(/,/, $allocs)) {
+    for my $workload (split(/,/, $workloads)) {
+        my $base;
+        for my $nthreads (@counts) {
+            my $run = run_bench($alloc, $workload, $nthreads);
+            my $ops_sec = $run->{ops} / $run->{seconds};
+            my $per_thread = $ops_sec / $nthreads;
+            $base //= $per_thread;
+            push @rows, {
+                allocator => $alloc,
+                workload => $workload,
+                threads => 0 + $nthreads,
+                top => $top,
+                seconds => $run->{seconds},
+                ops => $run->{ops},
+                ops_per_sec => sprintf("%.0f", $ops_sec) + 0,
+                ops_per_sec_per_thread => sprintf("%.0f", $per_thread) + 0,
+                efficiency => sprintf("%.3f", $per_thread / $base) + 0,
+            };
+            say STDERR "$alloc $workload threads=$nthreads: ",
+                sprintf("%.3fs, %.0f ops/s", $run->{seconds}, $ops_sec);
+        }
+    }
+}
+
+my @cols = qw(allocator workload threads top seconds ops
+              ops_per_sec ops_per_sec_per_thread efficiency);
+
+my $text;
+if ($json) {
+    $text = JSON::PP->new->canonical->pretty->encode(\@rows);
+}
+else {
+    $text = join(",", @cols) . "\n";
+    for my $row (@rows) {
+        $text .= join(",", map { $row->{$_} } @cols) . "\n";
+    }
+}
+
+if ($out ne "") {
+    open(my $fh, ">", $out) or die "can't write $out: $!\n";
+    print $fh $text;
+    close($fh);
+}
+else {
+    print $text;
+}
@@ -0,0 +1,245 @@
+// Scalability benchmark.
+//
+// Runs the same Collatz workloads as ivec_main.c and list_main.c, but
+// with the number of threads given on the command line, and reports how
+// long it took and how many allocator calls were made:
+//
+//   bench-opt ivec|list TOP THREADS
+//
+// prints one CSV line: workload,threads,top,seconds,ops
+//
+// Allocator calls are counted by linking with --wrap (see the Makefile),
+// so the allocator itself is untouched. bench.pl sweeps thread counts
+// and allocators and works out throughput and scaling efficiency.
+
+#include <stdio.h>
+#include <pthread.h>
+#include <assert.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "ivec.h"
+#include "list.h"
+
+typedef struct num_task {
+    ivec* vec;
+    cell* list;
+    long  steps;
+    int   dibs;
+    pthread_mutex_t lock;
+} num_task;
+
+num_task** tasks;
+long data_top = 0;
+int use_list = 0;
+
+static __thread long thread_ops = 0;
+static atomic_long total_ops = 0;
+
+void* __real_xmalloc(size_t bytes);
+void  __real_xfree(void* ptr);
+void* __real_xrealloc(void* item, size_t size);
+void  __real_xfree_sized(void* ptr, size_t size);
+void* __real_xcalloc(size_t nmemb, size_t size);
+
+void*
+__wrap_xmalloc(size_t bytes)
+{
+    thread_ops++;
+    return __real_xmalloc(bytes);
+}
+
+void
+__wrap_xfree(void* ptr)
+{
+    thread_ops++;
+    __real_xfree(ptr);
+}
+
+void*
+__wrap_xrealloc(void* item, size_t size)
+{
+    thread_ops++;
+    return __real_xrealloc(item, size);
+}
+
+void
+__wrap_xfree_sized(void* ptr, size_t size)
+{
+    thread_ops++;
+    __real_xfree_sized(ptr, size);
+}
+
+void*
+__wrap_xcalloc(size_t nmemb, size_t size)
+{
+    thread_ops++;
+    return __real_xcalloc(nmemb, size);
+}
+
+long
+collatz_step(long n)
+{
+    if (n % 2 == 0) {
+        return n/2;
+    }
+    else {
+        return 3*n + 1;
+    }
+}
+
+// Advances one task by up to 50 steps, returns 1 if it was already done.
+int
+advance_ivec(num_task* task)
+{
+    ivec* xs = task->vec;
+    if (ivec_last(xs) <= 1) {
+        if (task->steps == -1) {
+            task->steps = xs->size - 1;
+        }
+        return 1;
+    }
+
+    xs = ivec_copy(xs);
+    long vv = 0;
+    for (int jj = 0; vv != 1 && jj < 50; ++jj) {
+        vv = collatz_step(ivec_last(xs));
+        ivec_push(xs, vv);
+    }
+    free_ivec(task->vec);
+    task->vec = xs;
+    return 0;
+}
+
+int
+advance_list(num_task* task)
+{
+    cell* xs = task->list;
+    if (xs->item <= 1) {
+        if (task->steps == -1) {
+            task->steps = count_list(xs) - 1;
+        }
+        return 1;
+    }
+
+    xs = copy_list(xs);
+    long vv = 0;
+    for (int jj = 0; vv != 1 && jj < 50; ++jj) {
+        vv = collatz_step(xs->item);
+        xs = cons(vv, xs);
+    }
+    free_list(task->list);
+    task->list = xs;
+    return 0;
+}
+
+int
+scan_and_iterate()
+{
+    long done_count = 0;
+    long base = random() % data_top;
+
+    for (long i0 = 1; i0 < data_top; ++i0) {
+        long ii = 1 + (base + i0) % (data_top - 1);
+
+        pthread_mutex_lock(&(tasks[ii]->lock));
+        int skip = tasks[ii]->dibs;
+        if (!skip) {
+            tasks[ii]->dibs = 1;
+        }
+        pthread_mutex_unlock(&(tasks[ii]->lock));
+        if (skip) {
+            continue;
+        }
+
+        if (use_list) {
+            done_count += advance_list(tasks[ii]);
+        }
+        else {
+            done_count += advance_ivec(tasks[ii]);
+        }
+
+        pthread_mutex_lock(&(tasks[ii]->lock));
+        tasks[ii]->dibs = 0;
+        pthread_mutex_unlock(&(tasks[ii]->lock));
+    }
+
+    return done_count == (data_top - 1);
+}
+
+void*
+worker(void* _arg)
+{
+    int done = 0;
+    while (!done) {
+        done = scan_and_iterate();
+    }
+    atomic_fetch_add(&total_ops, thread_ops);
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 4 || (strcmp(argv[1], "ivec") != 0 && strcmp(argv[1], "list") != 0)) {
+        printf("Usage:\n");
+        printf("\t%s ivec|list TOP THREADS\n", argv[0]);
+        return 1;
+    }
+
+    use_list = strcmp(argv[1], "list") == 0;
+    data_top = atol(argv[2]);
+    int nthreads = atoi(argv[3]);
+    assert(data_top > 1 && nthreads > 0);
+
+    tasks = xmalloc(data_top * sizeof(num_task*));
+    for (int ii = 0; ii < data_top; ++ii) {
+        tasks[ii] = xmalloc(sizeof(num_task));
+        if (use_list) {
+            tasks[ii]->list = cons(ii, 0);
+        }
+        else {
+            tasks[ii]->vec = make_ivec(4);
+            ivec_push(tasks[ii]->vec, ii);
+        }
+        tasks[ii]->steps = -1;
+        tasks[ii]->dibs  = 0;
+        pthread_mutex_init(&(tasks[ii]->lock), 0);
+    }
+
+    pthread_t* threads = malloc(nthreads * sizeof(pthread_t));
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    for (int ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_create(&(threads[ii]), 0, worker, 0);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < nthreads; ++ii) {
+        int rv = pthread_join(threads[ii], 0);
+        assert(rv == 0);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+    free(threads);
+
+    for (int ii = 0; ii < data_top; ++ii) {
+        if (use_list) {
+            free_list(tasks[ii]->list);
+        }
+        else {
+            free_ivec(tasks[ii]->vec);
+        }
+        xfree(tasks[ii]);
+    }
+    xfree(tasks);
+
+    printf("%s,%d,%ld,%.6f,%ld\n", argv[1], nthreads, data_top, seconds, atomic_load(&total_ops));
+    return 0;
+}
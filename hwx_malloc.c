@@ -293,6 +293,25 @@ xrealloc(void *item, size_t size) {
     }
 }
 
+// The header has the size anyway.
+void
+xfree_sized(void* item, size_t size)
+{
+    xfree(item);
+}
+
+void*
+xcalloc(size_t nmemb, size_t size)
+{
+    if (size != 0 && nmemb > (size_t)-1 / size) {
+        return 0;
+    }
+
+    void* item = xmalloc(nmemb * size);
+    memset(item, 0, nmemb * size);
+    return item;
+}
+
 /////////////////////////////////////////////////////////////////////
 ////////////////////////////// llist.c //////////////////////////////
 
@@ -317,44 +336,54 @@ llist_length(llist_node* list_head)
 }
 
 //inserts a given node and coelesces it when necessary
+// (a loop rather than recursion, so long lists can't run out of stack)
 llist_node*
 llist_insert(llist_node* to_insert, llist_node* list_head)
 {
-    if (list_head == NULL)
-    {
-        to_insert->next = NULL;
-        return to_insert;
-    }
+    llist_node* result = NULL;
+    llist_node** link = &result; // where the node that ends up in this spot goes
 
-    // inserting before (or at if the size is big enough) the head
-    if (to_insert < list_head)
+    while (list_head != NULL)
     {
-        // Any two adjacent blocks on the free list get coalesced (joined together) into one bigger block.
-        // This is the special case where the head needs to be coalesced, by something in front of it
-        if ((void*)to_insert + to_insert->size == list_head)
+        // inserting before (or at if the size is big enough) the head
+        if (to_insert < list_head)
         {
-            //at head, in front
-            to_insert->size += list_head->size; // add the list to the node
-            to_insert->next = list_head->next; // replace the head with the node
-            return to_insert;
+            // Any two adjacent blocks on the free list get coalesced (joined together) into one bigger block.
+            // This is the special case where the head needs to be coalesced, by something in front of it
+            if ((void*)to_insert + to_insert->size == list_head)
+            {
+                //at head, in front
+                to_insert->size += list_head->size; // add the list to the node
+                to_insert->next = list_head->next; // replace the head with the node
+            }
+            else
+            {
+                // replace the head with the node, but keep the head (don't coalesce)
+                to_insert->next = list_head;
+            }
+            *link = to_insert;
+            return result;
         }
 
-        // replace the head with the node, but keep the head (don't coalesce)
-        to_insert->next = list_head;
-        return to_insert;
-    }
-
-    // Any two adjacent blocks on the free list get coalesced (joined together) into one bigger block.
-    if ((void*)list_head + list_head->size == to_insert)
-    {
-        //at head, behind
-        list_head->size += to_insert->size;
-        return llist_insert(list_head, list_head->next); // head is now bigger, need to shift the list down
+        // Any two adjacent blocks on the free list get coalesced (joined together) into one bigger block.
+        if ((void*)list_head + list_head->size == to_insert)
+        {
+            //at head, behind
+            list_head->size += to_insert->size;
+            to_insert = list_head; // head is now bigger, need to shift the list down
+        }
+        else
+        {
+            // insert after head
+            *link = list_head;
+            link = &list_head->next;
+        }
+        list_head = list_head->next;
     }
 
-    // insert after head
-    list_head->next = llist_insert(to_insert, list_head->next);
-    return list_head;
+    to_insert->next = NULL;
+    *link = to_insert;
+    return result;
 }
 
 
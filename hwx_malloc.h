@@ -27,12 +27,17 @@ typedef struct hm_stats {
     long chunks_allocated;
     long chunks_freed;
     long free_length;
+    long chunks_reserved; // opt: chunks of address space mapped for slabs
+    long pages_carved;    // opt: pages of those chunks handed out as slabs
+    long bytes_flushed;   // opt: free bytes exited threads handed to other threads
 } hm_stats;
 
 hm_stats* hgetstats();
 void hprintstats();
 void* xmalloc(size_t size);
 void xfree(void* item);
+void xfree_sized(void* item, size_t size);
+void* xcalloc(size_t nmemb, size_t size);
 llist_node* xmallocHlp_get_free_block(size_t min_size);
 
 
@@ -28,8 +28,8 @@ static
 void
 free_ivec(ivec* xs)
 {
-    xfree(xs->data);
-    xfree(xs);
+    xfree_sized(xs->data, xs->cap * sizeof(long));
+    xfree_sized(xs, sizeof(ivec));
 }
 
 static
@@ -37,7 +37,7 @@ free_list(cell* xs)
 {
     while (xs) {
         cell* ys = xs->rest;
-        xfree(xs);
+        xfree_sized(xs, sizeof(cell));
         xs = ys;
     }
 }
@@ -1,12 +1,34 @@
 
+#define _GNU_SOURCE // for mremap
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <string.h>
 #include <stdio.h>
 #include <pthread.h>
 #include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#if defined(__linux__) && defined(__x86_64__) && __has_include(<sys/rseq.h>)
+#define OPT_HAVE_RSEQ 1
+#include <sys/rseq.h>
+#endif
+
+#ifdef OPT_LATENCY
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#else
+#include <time.h>
+#endif
+#endif
 
 #include "hwx_malloc.h"
+#include "opt_malloc.h"
 
 // The following papers were used as external reference:
 // 1. http://supertech.csail.mit.edu/papers/Kuszmaul15.pdf
@@ -16,8 +38,7 @@
 
 
 
-llist_node* xmallocHlp_get_free_block_2048(size_t min_size);
-llist_node* xmallocHlp_get_free_block_4096(size_t min_size);
+typedef struct heap heap;
 
 /////////////////////////////////////////////////////////////////////
 ////////////////////////////// hmalloc.c ////////////////////////////
@@ -35,405 +56,3733 @@ typedef struct hm_stats {
 
 const size_t PAGE_SIZE = 4096;
 const size_t HALF_PAGE_SIZE = 2048;
-__thread hm_stats stats; // This initializes the stats to 0.
+const size_t SLAB_SIZE = 16384; // Size class blocks are carved out of slabs of this many bytes.
+const size_t MEDIUM_MAX = 16384; // Blocks smaller than this (header included) are medium ...
+const size_t MEDIUM_SPAN_SIZE = 65536; // ... and are carved out of spans of this many bytes.
+const size_t CHUNK_SIZE = 1024 * 1024; // Slabs and spans are carved out of chunks of this many bytes.
+const size_t MAX_SIZE = PTRDIFF_MAX / 2; // Bigger requests fail, so sizes with headers and padding can't wrap.
+
+// Size classes for requests <= 2048 bytes. These blocks have no header,
+// their size comes from the page map (see below). Spacing is 16 bytes up
+// to 128, then 4 classes per power of two, so a block never wastes more
+// than 25% of its size to rounding.
+#define NUM_CLASSES OPT_NUM_CLASSES
+static const size_t class_sizes[NUM_CLASSES] = {
+    16, 32, 48, 64, 80, 96, 112, 128,
+    160, 192, 224, 256,
+    320, 384, 448, 512,
+    640, 768, 896, 1024,
+    1280, 1536, 1792, 2048,
+};
+
+// A magazine is a stack of free blocks of one size class (see magazines).
+typedef struct magazine {
+    struct magazine* next; // on a depot list
+    atomic_long count;
+    void* rounds[];        // mag_rounds[cls] of them
+} magazine;
+
+// Each size class hands out blocks of exactly one size. Freed blocks go
+// on a LIFO list in their own slab, and slabs with free blocks on a list
+// of the class, fresh blocks are bumped out of the current slab, so both
+// allocation and free are O(1) no matter how many blocks are free.
+typedef struct size_class {
+    struct span* partial;  // slabs with free blocks, the last freed into first
+    void* slab_next;       // next never-used block in the current slab
+    void* slab_end;        // end of the last whole block in the current slab
+    atomic_long free_length;
+} size_class;
+
+#ifdef OPT_TLSF
+
+// Free medium blocks are kept TLSF style (two level segregated fit): a
+// list per size range, 16 ranges for every power of two, and a two level
+// bitmap of which lists are non empty. Finding a good fit is a couple of
+// bit scans, and coalescing uses boundary tags, so both are O(1).
+#define TLSF_SL_BITS 4
+#define TLSF_SL_COUNT (1 << TLSF_SL_BITS)
+#define TLSF_FL_COUNT 17 // a block never outgrows its span (64K)
+
+typedef struct medium_node {
+    size_t size; // block size | flags, the header of a used block too
+    struct medium_node* next_free;
+    struct medium_node* prev_free;
+    // ... and a copy of the size in the last word of the block
+} medium_node;
+
+typedef struct medium_index {
+    uint32_t fl_bitmap;
+    uint32_t sl_bitmap[TLSF_FL_COUNT];
+    medium_node* lists[TLSF_FL_COUNT][TLSF_SL_COUNT];
+    atomic_long free_length;
+} medium_index;
+
+#else
+
+// Free medium blocks are threaded onto two skip lists: one ordered by
+// address, to find the neighbours to coalesce with, and one by (size,
+// address), to find the best fit. Both take O(log n) expected steps, and
+// the node lives in the free block itself, over its size header.
+#define MEDIUM_LEVELS 8
+
+typedef struct medium_node {
+    size_t size;  // block size, same place as the header of a used block
+    long levels;  // how many of the links below are in use
+    struct medium_node* by_addr[MEDIUM_LEVELS];
+    struct medium_node* by_size[MEDIUM_LEVELS];
+} medium_node;
+
+typedef struct medium_index {
+    medium_node* by_addr[MEDIUM_LEVELS]; // list heads
+    medium_node* by_size[MEDIUM_LEVELS];
+    uint64_t rng; // picks node levels
+    atomic_long free_length;
+} medium_index;
+
+#endif
+
+// Latency histograms have 4 log scale buckets per power of two of cycles.
+#define LAT_BUCKETS 252
+
+// Counters for one heap. Only the thread using the heap writes them, with
+// relaxed loads and stores rather than read-modify-writes (see stat_add),
+// so counting costs the same as it did with plain __thread stats. Any
+// thread may read them; xmalloc_get_stats() sums them over all heaps.
+typedef struct heap_stats {
+    atomic_long allocs;
+    atomic_long frees;
+    atomic_long bytes_allocated;
+    atomic_long bytes_freed;
+    atomic_long chunks_reserved;
+    atomic_long pages_carved;
+    atomic_long class_allocs[NUM_CLASSES];
+    atomic_long class_frees[NUM_CLASSES];
+    atomic_long pages_purged;
+    atomic_long purges;
+    atomic_long empty_slabs;
+#ifdef OPT_LATENCY
+    atomic_long latency[OPT_LAT_SIZES][OPT_LAT_PATHS][LAT_BUCKETS];
+#endif
+} heap_stats;
+
+// How many of the pages (or slabs, or anything) that became dirty over
+// the last DECAY_EPOCHS epochs may still be dirty (see purger).
+#define DECAY_EPOCHS 20
+
+typedef struct decay {
+    long backlog[DECAY_EPOCHS]; // made dirty in each epoch, newest first
+    long last;                  // dirty at the end of the last epoch
+} decay;
+
+// Every thread allocates out of its own heap. Heaps are mmapped rather
+// than __thread so other threads can still reach them to hand back blocks.
+struct heap {
+    size_class classes[NUM_CLASSES];
+
+    // This thread's magazines, a loaded and a previous one per class.
+    // Atomic as xmalloc_get_stats reads them from other threads; only the
+    // owner changes them, and only when it swaps magazines.
+    _Atomic(magazine*) loaded[NUM_CLASSES];
+    _Atomic(magazine*) previous[NUM_CLASSES];
+
+    // Blocks that don't fit a size class (2048 < size < 16K) keep a size
+    // header, and are indexed here while free.
+    medium_index medium;
+
+    // Blocks freed by other threads. Any thread may push (lock-free stack),
+    // only the owner pops, and it takes the whole list at once so there's no ABA.
+    _Atomic(llist_node*) remote_free;
+
+    // Address space reserved up front with one mmap. New slabs are bumped
+    // out of it, so a thread pays one syscall (and one VMA) per chunk
+    // instead of one per slab.
+    void* chunk_next;
+    void* chunk_end;
+
+    // Slabs all of whose blocks were free (see purging), the last emptied
+    // first. New slabs come from here first, dirty ones (pages still
+    // there) before those whose pages were given back. The purger thread
+    // gives back dirty ones too, so both lists are under slab_lock.
+    pthread_mutex_t slab_lock;
+    struct span* dirty_slabs;
+    struct span* empty_slabs;
+    atomic_long dirty_count;
+    decay decay;       // of the dirty slabs, only the purger uses it
+    long purge_tick;   // frees onto our lists left until the next check
+
+    struct heap* next_orphan; // link on orphan_heaps once its thread has exited
+    struct heap* next_heap;   // link on all_heaps, heaps are never removed from it
+
+    heap_stats stats;
+};
+
+// Describes one slab. These live off to the side (see meta_alloc) and are
+// found through the page map, so slab memory is nothing but blocks.
+typedef struct span {
+    heap* owner;
+    long cls;              // size class of the blocks, or -1 for medium blocks
+    void* start;
+    struct span* next;     // link on the class's partial slabs, or the owner's empty slabs
+    struct span* prev;     // back link on the partial slabs
+    llist_node* free_list; // this slab's free blocks, only ->next is used
+    long free_count;       // how many
+} span;
+
+__thread heap* local_heap = NULL;
+
+// Full magazines handed in by threads, and empty ones, per class.
+typedef struct depot {
+    pthread_mutex_t lock;
+    magazine* full;
+    magazine* empty;
+    atomic_long full_count;
+    atomic_long blocks;
+} depot;
+
+static depot depots[NUM_CLASSES] = {
+    [0 ... NUM_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER },
+};
 
-// Using 2 lists to store memory blocks in different size ranges to minimize the number of nodes to be searched in a particular linked list
-__thread llist_node* free_list_head_2048 = NULL;
-__thread llist_node* free_list_head_4096 = NULL;
 
+/////////////////////////////////////////////////////////////////////
+////////////////////////////// stats ////////////////////////////////
+
+// Process wide counters for the rare events (mmap, munmap, thread exit).
+// These are shared, so they're updated with atomic adds.
+static atomic_long pages_mapped;
+static atomic_long pages_unmapped;
+static atomic_long peak_pages_mapped;
+static atomic_long orphan_bytes; // total free bytes handed over by exited threads
+static atomic_long purger_passes;
+static atomic_long purger_pages;          // pages of dirty slabs the purger gave back
+static atomic_long purger_bytes_unmapped; // and bytes of cached large spans it unmapped
+
+// Every heap ever created, pushed lock-free and never removed, so stats of
+// exited threads (whose heaps sit on the orphan list) are still counted.
+static _Atomic(heap*) all_heaps;
+
+// Bumps a counter only the calling thread writes.
+static
+void
+stat_add(atomic_long* counter, long vv)
+{
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + vv,
+                          memory_order_relaxed);
+}
 
-// For free list with mem sizes >=2048 bytes
+static
 long
-free_list_length_4096()
+stat_get(atomic_long* counter)
+{
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+
+static
+void
+stat_set(atomic_long* counter, long vv)
 {
-    return llist_length(free_list_head_4096);
+    atomic_store_explicit(counter, vv, memory_order_relaxed);
 }
 
-// For the list of mem sizes <= 2048 bytes
+static
 long
-free_list_length_2048()
+magazine_count(magazine* mag)
+{
+    return mag != NULL ? stat_get(&mag->count) : 0;
+}
+
+static
+void
+stat_mapped(long pages)
 {
-    return llist_length(free_list_head_2048);
+    long now = atomic_fetch_add(&pages_mapped, pages) + pages - atomic_load(&pages_unmapped);
+    long peak = atomic_load(&peak_pages_mapped);
+    while (now > peak && !atomic_compare_exchange_weak(&peak_pages_mapped, &peak, now))
+    {
+    }
 }
 
-// For the free list with memsizes >=2048 
+static
 void
-free_list_insert_4096(llist_node* node)
+stat_unmapped(long pages)
 {
-    free_list_head_4096 = llist_insert(node, free_list_head_4096);
+    atomic_fetch_add(&pages_unmapped, pages);
 }
 
-// For the free list with memsize <=2048
+// Sums the counters of every heap. That's O(threads), never O(free blocks).
 void
-free_list_insert_2048(llist_node* node)
+xmalloc_get_stats(opt_stats* out)
 {
-    free_list_head_2048= llist_insert(node, free_list_head_2048);
+    memset(out, 0, sizeof(opt_stats));
+
+    for (heap* hh = atomic_load(&all_heaps); hh != NULL; hh = hh->next_heap)
+    {
+        heap_stats* hs = &hh->stats;
+        out->allocs += stat_get(&hs->allocs);
+        out->frees += stat_get(&hs->frees);
+        out->bytes_in_use += stat_get(&hs->bytes_allocated) - stat_get(&hs->bytes_freed);
+        out->chunks_reserved += stat_get(&hs->chunks_reserved);
+        out->pages_carved += stat_get(&hs->pages_carved);
+        out->free_blocks += stat_get(&hh->medium.free_length);
+
+        for (int ii = 0; ii < NUM_CLASSES; ++ii)
+        {
+            out->class_allocs[ii] += stat_get(&hs->class_allocs[ii]);
+            out->class_frees[ii] += stat_get(&hs->class_frees[ii]);
+            out->free_blocks += stat_get(&hh->classes[ii].free_length);
+            out->magazine_blocks += magazine_count(atomic_load_explicit(&hh->loaded[ii], memory_order_acquire));
+            out->magazine_blocks += magazine_count(atomic_load_explicit(&hh->previous[ii], memory_order_acquire));
+        }
+        out->pages_purged += stat_get(&hs->pages_purged);
+        out->purges += stat_get(&hs->purges);
+        out->empty_slabs += stat_get(&hs->empty_slabs);
+        out->dirty_slabs += stat_get(&hh->dirty_count);
+    }
+
+    for (int ii = 0; ii < NUM_CLASSES; ++ii)
+    {
+        out->depot_blocks += stat_get(&depots[ii].blocks);
+    }
+    out->free_blocks += out->magazine_blocks + out->depot_blocks;
+
+    for (int ii = 0; ii < NUM_CLASSES; ++ii)
+    {
+        out->class_sizes[ii] = class_sizes[ii];
+    }
+
+    out->pages_mapped = atomic_load(&pages_mapped);
+    out->pages_unmapped = atomic_load(&pages_unmapped);
+    out->bytes_mapped = (out->pages_mapped - out->pages_unmapped) * PAGE_SIZE;
+    out->peak_bytes_mapped = atomic_load(&peak_pages_mapped) * PAGE_SIZE;
+    out->bytes_flushed = atomic_load(&orphan_bytes);
+    out->purger_passes = atomic_load(&purger_passes);
+    out->purger_pages = atomic_load(&purger_pages);
+    out->purger_bytes_unmapped = atomic_load(&purger_bytes_unmapped);
+    out->pages_purged += out->purger_pages;
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    out->peak_rss = usage.ru_maxrss * 1024;
 }
 
 hm_stats*
 hgetstats()
 {
-    stats.free_length = free_list_length_4096() + free_list_length_2048();
+    static __thread hm_stats stats;
+    opt_stats all;
+    xmalloc_get_stats(&all);
+
+    stats.pages_mapped = all.pages_mapped;
+    stats.pages_unmapped = all.pages_unmapped;
+    stats.chunks_allocated = all.allocs;
+    stats.chunks_freed = all.frees;
+    stats.free_length = all.free_blocks;
+    stats.chunks_reserved = all.chunks_reserved;
+    stats.pages_carved = all.pages_carved;
+    stats.bytes_flushed = all.bytes_flushed;
     return &stats;
 }
 
 void
 hprintstats()
 {
-    stats.free_length = free_list_length_4096() + free_list_length_2048();
+    opt_stats all;
+    xmalloc_get_stats(&all);
+
     fprintf(stderr, "\n== husky malloc stats ==\n");
-    fprintf(stderr, "Mapped:   %ld\n", stats.pages_mapped);
-    fprintf(stderr, "Unmapped: %ld\n", stats.pages_unmapped);
-    fprintf(stderr, "Allocs:   %ld\n", stats.chunks_allocated);
-    fprintf(stderr, "Frees:    %ld\n", stats.chunks_freed);
-    fprintf(stderr, "Freelen:  %ld\n", stats.free_length);
+    fprintf(stderr, "Mapped:   %ld\n", all.pages_mapped);
+    fprintf(stderr, "Unmapped: %ld\n", all.pages_unmapped);
+    fprintf(stderr, "Allocs:   %ld\n", all.allocs);
+    fprintf(stderr, "Frees:    %ld\n", all.frees);
+    fprintf(stderr, "Freelen:  %ld\n", all.free_blocks);
+    fprintf(stderr, "Chunks:   %ld\n", all.chunks_reserved);
+    fprintf(stderr, "Carved:   %ld\n", all.pages_carved);
+    fprintf(stderr, "Flushed:  %ld\n", all.bytes_flushed);
+    fprintf(stderr, "InUse:    %ld\n", all.bytes_in_use);
+    fprintf(stderr, "PeakMap:  %ld\n", all.peak_bytes_mapped);
+    fprintf(stderr, "PeakRSS:  %ld\n", all.peak_rss);
+    fprintf(stderr, "Purged:   %ld\n", all.pages_purged);
+    if (all.purger_passes != 0)
+    {
+        fprintf(stderr, "Purger:   %ld passes, %ld pages, %ld bytes unmapped\n",
+                all.purger_passes, all.purger_pages, all.purger_bytes_unmapped);
+    }
+    for (int ii = 0; ii < NUM_CLASSES; ++ii)
+    {
+        if (all.class_allocs[ii] != 0)
+        {
+            fprintf(stderr, "  %4zu:   %ld allocs, %ld frees\n",
+                    all.class_sizes[ii], all.class_allocs[ii], all.class_frees[ii]);
+        }
+    }
 }
 
-static
-size_t
-div_up(size_t xx, size_t yy)
+/////////////////////////////////////////////////////////////////////
+///////////////////////////// latency ///////////////////////////////
+
+// With -DOPT_LATENCY, xmalloc and xfree count the cycles they take into
+// the calling thread's heap, in the histogram for the block's size and
+// the path the call took. The code on the way marks the path with
+// LAT_PATH; the rest of the time these compile to nothing.
+
+#ifdef OPT_LATENCY
+
+static __thread int lat_size;
+static __thread int lat_path;
+#define LAT_SIZE(ss) (lat_size = (ss))
+#define LAT_PATH(pp) (lat_path = (pp))
+
+static inline
+uint64_t
+lat_now()
 {
-    // This is useful to calculate # of pages
-    // for large allocations.
-    size_t zz = xx / yy;
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ul + ts.tv_nsec;
+#endif
+}
 
-    if (zz * yy == xx)
+// 0..3 get a bucket each, then 4 per power of two.
+static inline
+int
+lat_bucket(uint64_t cycles)
+{
+    if (cycles < 4)
     {
-        return zz;
+        return (int)cycles;
     }
-    else
+    int bits = 63 - __builtin_clzl(cycles);
+    return (bits - 1) * 4 + (int)((cycles >> (bits - 2)) & 3);
+}
+
+static
+void
+lat_record(heap_stats* hs, uint64_t cycles)
+{
+    stat_add(&hs->latency[lat_size][lat_path][lat_bucket(cycles)], 1);
+}
+
+// Records a call that started at start, into the calling thread's heap.
+// A thread that has none yet has nothing to record it in.
+static inline
+void
+lat_done(uint64_t start)
+{
+    if (local_heap != NULL)
     {
-        return zz + 1;
+        lat_record(&local_heap->stats, lat_now() - start);
     }
 }
 
-void*
-xmalloc(size_t size)
+// Largest value that lands in the given bucket.
+static
+long
+lat_bucket_max(int bb)
 {
-    stats.chunks_allocated += 1;
-    size += sizeof(size_t);
-    // Use the start of the block to store its size.
-    // Return a pointer to the block after the size field.
-    void* new_bstart;
-    size_t new_bsize;
-    
-    // For blocks of size < 2048 bytes
-    if (size < HALF_PAGE_SIZE){
+    if (bb < 4)
+    {
+        return bb;
+    }
+    int bits = bb / 4 + 1;
+    return ((long)(5 + bb % 4) << (bits - 2)) - 1;
+}
 
-        //See if there’s a big enough block on the free list. If so, select the first one ...
-        llist_node* node = xmallocHlp_get_free_block_2048(size);
+#else
 
-        //  ... and remove it from the list.
-        if (node != NULL)
-        {
-            new_bstart = (void*)node;
-            new_bsize = node->size;
-        }
-        else // If you don’t have a block, mmap a new block (1 page)
-        {
-            new_bsize = PAGE_SIZE;
-            new_bstart = mmap(NULL, new_bsize, PROT_READ | PROT_WRITE,
-                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-            assert(new_bstart != 0);
-            stats.pages_mapped += 1;
-        }
+#define LAT_SIZE(ss) ((void)0)
+#define LAT_PATH(pp) ((void)0)
 
-        // If the block is bigger than the request, and the leftover is big enough to
-        // store a free list cell, return the extra to the free list.
-        if (new_bsize - size > sizeof(llist_node))
-        {
-            llist_node* new_block = (llist_node*)(new_bstart + size);
-            new_block->size = new_bsize - size;
-            free_list_insert_2048(new_block);
-            new_bsize = size;
-        }
+#endif
 
-    }
-    // For blocks of size >= 2048 bytes
-    else{
+void
+xmalloc_get_latency(opt_latency out[OPT_LAT_SIZES][OPT_LAT_PATHS])
+{
+    memset(out, 0, sizeof(opt_latency) * OPT_LAT_SIZES * OPT_LAT_PATHS);
 
-        // Requests with (B < 1 page = 4096 bytes but >= 2048 bytes)
-        if (size < PAGE_SIZE)
+#ifdef OPT_LATENCY
+    for (int ss = 0; ss < OPT_LAT_SIZES; ++ss)
+    {
+        for (int pp = 0; pp < OPT_LAT_PATHS; ++pp)
         {
-
-            //See if there’s a big enough block on the free list. If so, select the first one ...
-            llist_node* node = xmallocHlp_get_free_block_4096(size);
-
-            //  ... and remove it from the list.
-            if (node != NULL)
+            long hist[LAT_BUCKETS] = {0};
+            long count = 0;
+            for (heap* hh = atomic_load(&all_heaps); hh != NULL; hh = hh->next_heap)
             {
-                new_bstart = (void*)node;
-                new_bsize = node->size;
-            }
-            else // If you don’t have a block, mmap a new block (1 page)
-            {
-                new_bsize = PAGE_SIZE;
-                new_bstart = mmap(NULL, new_bsize, PROT_READ | PROT_WRITE,
-                                MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-                assert(new_bstart != 0);
-                stats.pages_mapped += 1;
+                for (int bb = 0; bb < LAT_BUCKETS; ++bb)
+                {
+                    long nn = stat_get(&hh->stats.latency[ss][pp][bb]);
+                    hist[bb] += nn;
+                    count += nn;
+                }
             }
 
-            // If the block is bigger than the request, and the leftover is big enough to
-            // store a free list cell, return the extra to the free list.
-            if (new_bsize - size > sizeof(llist_node))
+            opt_latency* lat = &out[ss][pp];
+            lat->count = count;
+            long seen = 0;
+            for (int bb = 0; bb < LAT_BUCKETS && count > 0; ++bb)
             {
-                llist_node* new_block = (llist_node*)(new_bstart + size);
-                new_block->size = new_bsize - size;
-                free_list_insert_4096(new_block);
-                new_bsize = size;
+                if (hist[bb] == 0)
+                {
+                    continue;
+                }
+                seen += hist[bb];
+                if (lat->p50 == 0 && seen * 100 >= count * 50)
+                {
+                    lat->p50 = lat_bucket_max(bb);
+                }
+                if (lat->p99 == 0 && seen * 100 >= count * 99)
+                {
+                    lat->p99 = lat_bucket_max(bb);
+                }
+                if (lat->p999 == 0 && seen * 1000 >= count * 999)
+                {
+                    lat->p999 = lat_bucket_max(bb);
+                }
+                lat->max = lat_bucket_max(bb);
             }
-
-        }
-        else // Requests with (B >= 1 page = 4096 bytes):
-        {
-            size_t num_pages = div_up(size, PAGE_SIZE); // Calculate the number of pages needed for this block.
-            new_bsize = PAGE_SIZE * num_pages; // // Allocate that many pages
-            new_bstart = mmap(NULL, new_bsize, PROT_READ | PROT_WRITE, // with mmap
-                            MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
-
-            assert(new_bstart != 0);
-            stats.pages_mapped += num_pages;
         }
     }
-    *((size_t*)new_bstart) = new_bsize;
-    return new_bstart + sizeof(size_t);
+#endif
 }
 
-// See if there’s a big enough block on the free list. If so, select the first one, remove it from the list, and return int
-// if not, return null
-llist_node*
-xmallocHlp_get_free_block_4096(size_t min_size)
+void
+xmalloc_print_latency()
 {
-    if (free_list_head_4096 == NULL)
-    {
-        return NULL;
-    }
+    static const char* size_names[OPT_LAT_SIZES] = {"small", "medium", "large"};
+    static const char* path_names[OPT_LAT_PATHS] = {
+        "alloc freelist", "alloc carve", "alloc mmap",
+        "free local", "free remote", "free unmap",
+    };
 
-    llist_node* nn = free_list_head_4096;
+    opt_latency lats[OPT_LAT_SIZES][OPT_LAT_PATHS];
+    xmalloc_get_latency(lats);
 
-    //head is big enough to use
-    if (free_list_head_4096->size >= min_size)
+    fprintf(stderr, "\n== opt malloc latency (cycles) ==\n");
+    for (int ss = 0; ss < OPT_LAT_SIZES; ++ss)
     {
-        free_list_head_4096 = free_list_head_4096->next;
-        return nn;
+        for (int pp = 0; pp < OPT_LAT_PATHS; ++pp)
+        {
+            opt_latency* lat = &lats[ss][pp];
+            if (lat->count != 0)
+            {
+                fprintf(stderr, "%-6s %-14s %10ld calls  p50 %6ld  p99 %8ld  p99.9 %8ld  max %10ld\n",
+                        size_names[ss], path_names[pp], lat->count,
+                        lat->p50, lat->p99, lat->p999, lat->max);
+            }
+        }
     }
+}
 
-    llist_node* pp;
+static
+size_t
+div_up(size_t xx, size_t yy)
+{
+    // This is useful to calculate # of pages
+    // for large allocations.
+    size_t zz = xx / yy;
 
-    //iterate through the rest of the nodes
-    do
+    if (zz * yy == xx)
     {
-        pp = nn; // need to update prev b4 iterating
-        nn = nn->next;
-
-        //stop if end of list OR found block big enough
-    } while (nn != NULL && nn->size < min_size);
-
-    if (nn != NULL) // didn't reach end of list
+        return zz;
+    }
+    else
     {
-        pp->next = nn->next;
+        return zz + 1;
     }
-
-    return nn;
 }
 
-llist_node*
-xmallocHlp_get_free_block_2048(size_t min_size)
+// Maps a request size (size <= 2048) to its class index.
+static
+int
+size_to_class(size_t size)
 {
-    if (free_list_head_2048 == NULL)
+    if (size <= 128)
     {
-        return NULL;
+        return size == 0 ? 0 : (int)((size + 15) / 16) - 1;
     }
 
-    llist_node* nn = free_list_head_2048;
+    // Above 128 each power of two [2^lg, 2^(lg+1)) is split in 4 steps.
+    int lg = 63 - __builtin_clzl(size - 1);
+    size_t step = (size_t)1 << (lg - 2);
+    return 8 + (lg - 7) * 4 + (int)((size - 1 - ((size_t)1 << lg)) / step);
+}
 
-    //head is big enough to use
-    if (free_list_head_2048->size >= min_size)
+/////////////////////////////////////////////////////////////////////
+/////////////////////////// large span cache ////////////////////////
+
+// Freed large (>= 1 page) blocks are parked here instead of being munmapped
+// right away, so the next large request of a similar size skips the mmap
+// and the page faults. Spans sit on LIFO lists bucketed by floor(log2(pages))
+// and the bytes parked are capped so RSS stays bounded.
+#define LARGE_CACHE_BUCKETS 48
+#define LARGE_CACHE_DEFAULT (4 * 1024 * 1024)
+
+static pthread_mutex_t large_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t large_cache_once = PTHREAD_ONCE_INIT;
+static llist_node* large_cache[LARGE_CACHE_BUCKETS];
+static size_t large_cache_bytes = 0;
+static size_t large_cache_limit = LARGE_CACHE_DEFAULT;
+
+// The cap can also be set from the environment, for programs we can't edit.
+static
+void
+large_cache_init()
+{
+    const char* env = getenv("OPT_LARGE_CACHE_BYTES");
+    if (env != NULL)
     {
-        free_list_head_2048 = free_list_head_2048->next;
-        return nn;
+        large_cache_limit = strtoul(env, NULL, 10);
     }
+}
 
-    llist_node* pp;
-
-    //iterate through the rest of the nodes
-    do
-    {
-        pp = nn; // need to update prev b4 iterating
-        nn = nn->next;
-
-        //stop if end of list OR found block big enough
-    } while (nn != NULL && nn->size < min_size);
+static
+int
+large_cache_bucket(size_t num_pages)
+{
+    return 63 - __builtin_clzl(num_pages);
+}
 
-    if (nn != NULL) // didn't reach end of list
+// Unmaps cached spans, biggest buckets first, until at most limit bytes
+// are left. Returns the bytes unmapped.
+static
+size_t
+large_cache_trim(size_t limit)
+{
+    size_t bytes = 0;
+    pthread_mutex_lock(&large_cache_lock);
+    for (int bb = LARGE_CACHE_BUCKETS - 1; bb >= 0 && large_cache_bytes > limit; --bb)
     {
-        pp->next = nn->next;
+        while (large_cache[bb] != NULL && large_cache_bytes > limit)
+        {
+            llist_node* span = large_cache[bb];
+            large_cache[bb] = span->next;
+            large_cache_bytes -= span->size;
+            bytes += span->size;
+            stat_unmapped(span->size / PAGE_SIZE);
+            munmap(span, span->size);
+        }
     }
-
-    return nn;
+    pthread_mutex_unlock(&large_cache_lock);
+    return bytes;
 }
 
 void
-xfree(void* item)
+xmalloc_set_large_cache_limit(size_t bytes)
 {
+    pthread_once(&large_cache_once, large_cache_init);
+    pthread_mutex_lock(&large_cache_lock);
+    large_cache_limit = bytes;
+    pthread_mutex_unlock(&large_cache_lock);
+    large_cache_trim(bytes);
+}
 
-    stats.chunks_freed += 1;
-
-    void* bstart = item - sizeof(size_t);
-    size_t bsize = *((size_t*)bstart);
+// Finds a cached span of at least num_pages, from its own bucket or the one
+// above, and unmaps whatever it has beyond num_pages. NULL if there's none.
+static
+void*
+large_cache_take(size_t num_pages)
+{
+    size_t bytes = num_pages * PAGE_SIZE;
+    int first = large_cache_bucket(num_pages);
+    llist_node* span = NULL;
 
-    if(bsize < HALF_PAGE_SIZE){
-        free_list_insert_2048((llist_node*)bstart); // then stick it on the free list.
-    }
-    // If the block is < 1 page
-    else if (bsize < PAGE_SIZE)
+    pthread_mutex_lock(&large_cache_lock);
+    for (int bb = first; span == NULL && bb <= first + 1 && bb < LARGE_CACHE_BUCKETS; ++bb)
     {
-        free_list_insert_4096((llist_node*)bstart); // then stick it on the free list.
+        for (llist_node** pp = &large_cache[bb]; *pp != NULL; pp = &(*pp)->next)
+        {
+            if ((*pp)->size >= bytes)
+            {
+                span = *pp;
+                *pp = span->next;
+                large_cache_bytes -= span->size;
+                break;
+            }
+        }
     }
-    else
+    pthread_mutex_unlock(&large_cache_lock);
+
+    if (span != NULL && span->size > bytes)
     {
-        int rv = munmap(bstart, bsize); // then munmap it.
-        assert(rv == 0);
-        stats.pages_unmapped += bsize / PAGE_SIZE;
+        munmap((void*)span + bytes, span->size - bytes);
+        stat_unmapped((span->size - bytes) / PAGE_SIZE);
     }
+    return span;
 }
 
-void *
-xrealloc(void *item, size_t size) {
+// Parks a freed span. Returns 0 if that would go over the cap, and then the
+// caller should munmap it.
+static
+int
+large_cache_put(void* bstart, size_t bsize)
+{
+    pthread_once(&large_cache_once, large_cache_init);
 
-    // if you're trying to reallocate the head,
-    // you are trying to realloc the entire list
-    if (item == NULL) {
-        return xmalloc(size);
+    int ok = 0;
+    pthread_mutex_lock(&large_cache_lock);
+    if (large_cache_bytes + bsize <= large_cache_limit)
+    {
+        llist_node* span = (llist_node*)bstart;
+        int bb = large_cache_bucket(bsize / PAGE_SIZE);
+        span->size = bsize;
+        span->next = large_cache[bb];
+        large_cache[bb] = span;
+        large_cache_bytes += bsize;
+        ok = 1;
+    }
+    pthread_mutex_unlock(&large_cache_lock);
+    return ok;
+}
+
+// mmaps fresh memory. If the address space is exhausted, the cached spans are
+// given back to the kernel and, if there were any, we try once more. Returns
+// NULL if that fails too.
+static
+void*
+xmallocHlp_map(size_t bytes)
+{
+    void* mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                     MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (mem == MAP_FAILED && large_cache_trim(0) > 0)
+    {
+        mem = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                   MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
     }
+    return mem == MAP_FAILED ? NULL : mem;
+}
+
+/////////////////////////////////////////////////////////////////////
+//////////////////////////// metadata ///////////////////////////////
 
-    size_t new_free;
-    void *new_ptr;
+// Span descriptors and page map nodes are bumped out of their own mmapped
+// region, never out of the heaps they describe. They are never freed.
+#define META_CHUNK_SIZE (256 * 1024)
 
-    // size of memory block to realloc:
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static void* meta_next = NULL;
+static void* meta_end = NULL;
 
-    /*
-     * I was gonna see if I could make this void* and use sizeof(block_header) to keep
-     * track of the how much memory is being realloced....
-     * but then i accidently settled on this, and im not sure why by substracting
-     * the size a normal size_t works
-     */
-    llist_node *block_header = ((llist_node *) (item - (sizeof(size_t))));
+// Returns zeroed memory for allocator bookkeeping.
+static
+void*
+meta_alloc(size_t bytes)
+{
+    bytes = div_up(bytes, 16) * 16;
 
-    // less memory is required
-    if (block_header->size > size + sizeof(llist_node)) {
+    pthread_mutex_lock(&meta_lock);
+    if (meta_next == NULL || (size_t)(meta_end - meta_next) < bytes)
+    {
+        size_t map_bytes = bytes > META_CHUNK_SIZE ? div_up(bytes, PAGE_SIZE) * PAGE_SIZE : META_CHUNK_SIZE;
+        meta_next = xmallocHlp_map(map_bytes);
+        assert(meta_next != NULL); // nothing works without its bookkeeping
+        meta_end = meta_next + map_bytes;
+        stat_mapped(map_bytes / PAGE_SIZE);
+    }
+    void* mem = meta_next;
+    meta_next += bytes;
+    pthread_mutex_unlock(&meta_lock);
 
-        llist_node *free_mem;
+    return mem;
+}
 
-        // new size of memory to add to free list
-        new_free = block_header->size - size;
+/////////////////////////////////////////////////////////////////////
+//////////////////////////// page map ///////////////////////////////
 
-        // set block size to new realloc size
-        block_header->size = size;
+// A three level radix tree from page number to the span that page belongs
+// to. 48 bit addresses with 4K pages leave 36 bits of page number, split
+// 12/12/12. Inner nodes are created on demand and never removed, so lookups
+// need no lock. Pages of large blocks are not in the map.
+#define PAGEMAP_BITS 12
+#define PAGEMAP_FANOUT (1 << PAGEMAP_BITS)
+#define PAGEMAP_MASK (PAGEMAP_FANOUT - 1)
 
-        // increment pointer value by new size
-        free_mem = (llist_node *) (item + size);
+typedef struct pagemap_leaf {
+    span* spans[PAGEMAP_FANOUT];
+} pagemap_leaf;
 
-        // subtract mapping overhead
-        new_free -= sizeof(llist_node);
-        free_mem->size = new_free;
+typedef struct pagemap_node {
+    _Atomic(pagemap_leaf*) leaves[PAGEMAP_FANOUT];
+} pagemap_node;
 
-        // if free list is empty add free memory to it
-        if (free_list_head_4096 == NULL) {
-            free_mem->next = NULL;
-            free_list_head_4096 = free_mem;
+static _Atomic(pagemap_node*) pagemap_root[PAGEMAP_FANOUT];
 
-        }
-        // if not first element add to free list
-        else {
-            llist_insert(free_list_head_4096, free_mem);
-        }
+// Finds the span for ptr, or NULL if ptr isn't in a slab.
+static
+span*
+pagemap_get(void* ptr)
+{
+    uintptr_t pn = (uintptr_t)ptr >> 12;
 
-        return item;
+    pagemap_node* node = atomic_load_explicit(&pagemap_root[(pn >> (2 * PAGEMAP_BITS)) & PAGEMAP_MASK],
+                                              memory_order_acquire);
+    if (node == NULL)
+    {
+        return NULL;
     }
-    // more memory is required
-    else if (block_header->size < size) {
 
-        // allocate new memory
-        new_ptr = xmalloc(size);
+    pagemap_leaf* leaf = atomic_load_explicit(&node->leaves[(pn >> PAGEMAP_BITS) & PAGEMAP_MASK],
+                                              memory_order_acquire);
+    if (leaf == NULL)
+    {
+        return NULL;
+    }
 
-        // copy old memory to new memory
-        memcpy(new_ptr, item, block_header->size);
+    return leaf->spans[pn & PAGEMAP_MASK];
+}
 
-        // free old memory
-        xfree(item);
+// Points every page in [start, start + bytes) at sp. Several threads may
+// race to create the same inner node; the loser's node is simply wasted.
+static
+void
+pagemap_set(void* start, size_t bytes, span* sp)
+{
+    for (uintptr_t pn = (uintptr_t)start >> 12; pn < ((uintptr_t)start + bytes) >> 12; ++pn)
+    {
+        _Atomic(pagemap_node*)* node_slot = &pagemap_root[(pn >> (2 * PAGEMAP_BITS)) & PAGEMAP_MASK];
+        pagemap_node* node = atomic_load_explicit(node_slot, memory_order_acquire);
+        if (node == NULL)
+        {
+            pagemap_node* fresh = meta_alloc(sizeof(pagemap_node));
+            node = atomic_compare_exchange_strong(node_slot, &node, fresh) ? fresh : node;
+        }
 
-        return new_ptr;
+        _Atomic(pagemap_leaf*)* leaf_slot = &node->leaves[(pn >> PAGEMAP_BITS) & PAGEMAP_MASK];
+        pagemap_leaf* leaf = atomic_load_explicit(leaf_slot, memory_order_acquire);
+        if (leaf == NULL)
+        {
+            pagemap_leaf* fresh = meta_alloc(sizeof(pagemap_leaf));
+            leaf = atomic_compare_exchange_strong(leaf_slot, &leaf, fresh) ? fresh : leaf;
+        }
 
-    }
-    // edge case if they are equal
-    else {
-        // return old pointer
-        return item;
+        leaf->spans[pn & PAGEMAP_MASK] = sp;
     }
 }
 
 /////////////////////////////////////////////////////////////////////
-////////////////////////////// llist.c //////////////////////////////
+////////////////////////////// slabs ////////////////////////////////
 
-// based on generic linked list code and lecture code
+// Reserves a new chunk of address space for hh. Returns 0 if there's none.
+static
+int
+xmallocHlp_reserve_chunk(heap* hh)
+{
+    LAT_PATH(OPT_LAT_ALLOC_MMAP);
+    void* start = xmallocHlp_map(CHUNK_SIZE);
+    if (start == NULL)
+    {
+        return 0;
+    }
+    stat_mapped(CHUNK_SIZE / PAGE_SIZE);
+    stat_add(&hh->stats.chunks_reserved, 1);
 
-/*
-typedef struct llist_node {
-    size_t size;     // size of one node (which represents one free block)
-    struct free_list_node* next; // NULL if end of list
-} free_list_node;
-*/
+    hh->chunk_next = start;
+    hh->chunk_end = start + CHUNK_SIZE;
+    return 1;
+}
 
-long
-llist_length(llist_node* list_head)
+// Carves a fresh slab (cls >= 0) or medium span (cls -1) of the given size
+// owned by hh out of its current chunk, and registers it in the page map.
+// Returns NULL if a new chunk was needed and couldn't be had.
+static
+void*
+xmallocHlp_new_span(heap* hh, long cls, size_t bytes)
 {
-    long length = 0;
-    for (llist_node* node = list_head; node != NULL; node = node->next)
+    if ((size_t)(hh->chunk_end - hh->chunk_next) < bytes && !xmallocHlp_reserve_chunk(hh))
     {
-        length++;
+        return NULL;
     }
-    return length;
+
+    void* start = hh->chunk_next;
+    hh->chunk_next += bytes;
+    stat_add(&hh->stats.pages_carved, bytes / PAGE_SIZE);
+
+    span* sp = meta_alloc(sizeof(span));
+    sp->owner = hh;
+    sp->cls = cls;
+    sp->start = start;
+    pagemap_set(start, bytes, sp);
+    return start;
 }
 
-//inserts a given node and coelesces it when necessary
-llist_node*
-llist_insert(llist_node* to_insert, llist_node* list_head)
+// Gives the whole pages in [start, end) back to the kernel, keeping the
+// mapping. Unless now is set they go lazily (MADV_FREE): the kernel only
+// takes them when it needs memory, and until then reusing them costs
+// nothing. Kernels without MADV_FREE (before Linux 4.5) get MADV_DONTNEED,
+// which drops them right away. Returns how many pages that was.
+static int purge_lazy = 1;
+
+static
+long
+xmallocHlp_purge_pages(void* start, void* end, int now)
 {
-    if (list_head == NULL)
+    start = (void*)(div_up((uintptr_t)start, PAGE_SIZE) * PAGE_SIZE);
+    end = (void*)((uintptr_t)end / PAGE_SIZE * PAGE_SIZE);
+    if (end <= start)
     {
-        to_insert->next = NULL;
-        return to_insert;
+        return 0;
     }
 
-    // inserting before (or at if the size is big enough) the head
-    if (to_insert < list_head)
+#ifdef MADV_FREE
+    if (!now && purge_lazy)
     {
-        // Any two adjacent blocks on the free list get coalesced (joined together) into one bigger block.
-        // This is the special case where the head needs to be coalesced, by something in front of it
-        if ((void*)to_insert + to_insert->size == list_head)
+        if (madvise(start, end - start, MADV_FREE) == 0)
         {
-            //at head, in front
-            to_insert->size += list_head->size; // add the list to the node
-            to_insert->next = list_head->next; // replace the head with the node
-            return to_insert;
+            return (end - start) / PAGE_SIZE;
         }
-
-        // replace the head with the node, but keep the head (don't coalesce)
-        to_insert->next = list_head;
-        return to_insert;
+        purge_lazy = 0;
     }
+#endif
+    int rv = madvise(start, end - start, MADV_DONTNEED);
+    assert(rv == 0);
+    return (end - start) / PAGE_SIZE;
+}
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// per-cpu caches ///////////////////////////
+
+// Optional (OPT_PERCPU=1 in the environment, Linux/x86-64 only): a small
+// stack of free size class blocks per CPU, in front of the thread heaps.
+// Push and pop run as restartable sequences (rseq), so they need neither
+// locks nor atomics: if the thread is preempted or migrated mid-sequence
+// the kernel restarts it, and the single store that commits it happens on
+// the right CPU or not at all. Cached memory then scales with CPUs rather
+// than threads, and a block freed by a thread is reused by whoever runs
+// next on that CPU. Misses and overflows fall through to the heaps, and
+// so does everything when rseq isn't registered.
+#define PERCPU_SLOTS 31
+
+typedef struct percpu_stack {
+    long count;
+    void* slots[PERCPU_SLOTS];
+} percpu_stack;
 
-    // Any two adjacent blocks on the free list get coalesced (joined together) into one bigger block.
-    if ((void*)list_head + list_head->size == to_insert)
+typedef struct percpu_cache {
+    percpu_stack classes[NUM_CLASSES];
+} percpu_cache;
+
+static int percpu_enabled = 0;
+
+#ifdef OPT_HAVE_RSEQ
+
+static percpu_cache* percpu_caches = NULL;
+
+// glibc registers an rseq area for every thread; this is the calling thread's.
+static
+struct rseq*
+percpu_rseq()
+{
+    return (struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset);
+}
+
+static
+void
+percpu_init()
+{
+    const char* env = getenv("OPT_PERCPU");
+    if (env == NULL || atoi(env) == 0 || __rseq_size == 0 || (int)percpu_rseq()->cpu_id < 0)
     {
-        //at head, behind
-        list_head->size += to_insert->size;
-        return llist_insert(list_head, list_head->next); // head is now bigger, need to shift the list down
+        return;
     }
 
-    // insert after head
-    list_head->next = llist_insert(to_insert, list_head->next);
-    return list_head;
-}
\ No newline at end of file
+    long ncpu = sysconf(_SC_NPROCESSORS_CONF);
+    percpu_caches = meta_alloc(ncpu * sizeof(percpu_cache));
+    percpu_enabled = 1;
+}
+
+// Both sequences below are registered through rs->rseq_cs before they read
+// cpu_id. The abort handler lives out of line behind the RSEQ_SIG signature
+// the kernel checks, and just retries. Labels: 1 start, 2 end of the commit
+// store, 3 the rseq_cs descriptor, 4 the abort handler.
+#define PERCPU_RSEQ_PROLOGUE \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" \
+    ".long 0x53053053\n\t" \
+    "4:\n\t" \
+    "jmp %l[aborted]\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, 8(%[rs])\n\t" \
+    "1:\n\t" \
+    "movl 4(%[rs]), %%eax\n\t" \
+    "imulq %[stride], %%rax\n\t" \
+    "addq %[base], %%rax\n\t"
+
+// Pops a block of class cls off this CPU's stack, or NULL if it's empty.
+static
+void*
+percpu_pop(int cls)
+{
+    struct rseq* rs = percpu_rseq();
+    void* item;
+
+    // The block goes out through memory rather than an asm goto output,
+    // which older compilers either don't support or get wrong.
+retry:
+    __asm__ goto (
+        PERCPU_RSEQ_PROLOGUE
+        "movq (%%rax), %%rdx\n\t"
+        "testq %%rdx, %%rdx\n\t"
+        "jz %l[empty]\n\t"
+        "movq (%%rax, %%rdx, 8), %%rcx\n\t"
+        "movq %%rcx, (%[item])\n\t"
+        "decq %%rdx\n\t"
+        "movq %%rdx, (%%rax)\n\t"
+        "2:\n\t"
+        :
+        : [rs] "r" (rs),
+          [stride] "r" ((long)sizeof(percpu_cache)),
+          [base] "r" (&percpu_caches->classes[cls]),
+          [item] "r" (&item)
+        : "rax", "rcx", "rdx", "memory", "cc"
+        : aborted, empty);
+    return item;
+
+aborted:
+    goto retry;
+empty:
+    return NULL;
+}
+
+// Pushes a block of class cls onto this CPU's stack. Returns 0 if it's full.
+static
+int
+percpu_push(int cls, void* item)
+{
+    struct rseq* rs = percpu_rseq();
+
+retry:
+    __asm__ goto (
+        PERCPU_RSEQ_PROLOGUE
+        "movq (%%rax), %%rdx\n\t"
+        "cmpq %[cap], %%rdx\n\t"
+        "jae %l[full]\n\t"
+        "movq %[item], 8(%%rax, %%rdx, 8)\n\t"
+        "incq %%rdx\n\t"
+        "movq %%rdx, (%%rax)\n\t"
+        "2:\n\t"
+        :
+        : [rs] "r" (rs),
+          [stride] "r" ((long)sizeof(percpu_cache)),
+          [base] "r" (&percpu_caches->classes[cls]),
+          [cap] "i" (PERCPU_SLOTS),
+          [item] "r" (item)
+        : "rax", "rdx", "memory", "cc"
+        : aborted, full);
+    return 1;
+
+aborted:
+    goto retry;
+full:
+    return 0;
+}
+
+#else
+
+static void percpu_init() {}
+static void* percpu_pop(int cls) { return NULL; }
+static int percpu_push(int cls, void* item) { return 0; }
+
+#endif
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////////// heaps ////////////////////////////////
+
+// When a thread exits, its heap (free blocks, partly used slabs and the
+// rest of its chunk) is parked on this list instead of being leaked, and
+// the next thread to start adopts it whole. Spans keep pointing at the
+// heap, so blocks still out in the program find their way back to it.
+static pthread_once_t heap_once = PTHREAD_ONCE_INIT;
+static pthread_key_t heap_key;
+static pthread_mutex_t orphan_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t fork_once = PTHREAD_ONCE_INIT;
+static heap* orphan_heaps = NULL;
+
+static void xmallocHlp_drain_remote(heap* hh);
+static void* xmallocHlp_class_alloc(heap* hh, int cls);
+static size_t medium_free_bytes(medium_index* mi);
+static void xmallocHlp_pool_release();
+static void xmallocHlp_pool_lock_all();
+static void xmallocHlp_pool_unlock_all();
+static void magazine_init();
+static void magazine_release(heap* hh);
+static int purge_enabled;
+static void purge_init();
+static void purger_init();
+static pthread_mutex_t purger_lock;
+static pthread_once_t purger_once;
+static atomic_int purger_running;
+static atomic_long decay_ms;
+static void xmallocHlp_maybe_purge(heap* hh);
+static void xmallocHlp_retire_slab(heap* hh, span* sp);
+static long xmallocHlp_heap_purge(heap* hh, int now);
+
+// Counts the bytes sitting unused in hh.
+static
+size_t
+xmallocHlp_heap_free_bytes(heap* hh)
+{
+    size_t bytes = hh->chunk_end - hh->chunk_next;
+    for (int ii = 0; ii < NUM_CLASSES; ++ii)
+    {
+        size_class* sc = &hh->classes[ii];
+        bytes += stat_get(&sc->free_length) * class_sizes[ii] + (sc->slab_end - sc->slab_next);
+    }
+    bytes += stat_get(&hh->stats.empty_slabs) * SLAB_SIZE;
+    return bytes + medium_free_bytes(&hh->medium);
+}
+
+// pthread key destructor, runs as the owning thread exits.
+static
+void
+xmallocHlp_release_heap(void* arg)
+{
+    heap* hh = (heap*)arg;
+    xmallocHlp_pool_release();
+    magazine_release(hh);
+    xmallocHlp_drain_remote(hh);
+    if (purge_enabled)
+    {
+        xmallocHlp_heap_purge(hh, 0);
+    }
+    atomic_fetch_add_explicit(&orphan_bytes, xmallocHlp_heap_free_bytes(hh), memory_order_relaxed);
+
+    local_heap = NULL;
+    pthread_mutex_lock(&orphan_lock);
+    hh->next_orphan = orphan_heaps;
+    orphan_heaps = hh;
+    pthread_mutex_unlock(&orphan_lock);
+}
+
+static
+void
+xmallocHlp_init()
+{
+    percpu_init();
+    magazine_init();
+    purge_init();
+    pthread_key_create(&heap_key, xmallocHlp_release_heap);
+#ifdef OPT_LATENCY
+    if (getenv("OPT_LATENCY_DUMP") != NULL)
+    {
+        atexit(xmalloc_print_latency);
+    }
+#endif
+}
+
+// A fork from one thread while another holds a lock would leave the
+// child with it locked for good, so they're all taken around fork(): the
+// global ones, then every heap's slab lock. Heaps made meanwhile aren't
+// locked, so only those up to fork_heaps are unlocked.
+static heap* fork_heaps;
+
+static
+void
+xmallocHlp_fork_prepare()
+{
+    pthread_mutex_lock(&purger_lock);
+    pthread_mutex_lock(&orphan_lock);
+    xmallocHlp_pool_lock_all();
+    pthread_mutex_lock(&large_cache_lock);
+    pthread_mutex_lock(&meta_lock);
+    for (int ii = 0; ii < NUM_CLASSES; ++ii)
+    {
+        pthread_mutex_lock(&depots[ii].lock);
+    }
+
+    fork_heaps = atomic_load(&all_heaps);
+    for (heap* hh = fork_heaps; hh != NULL; hh = hh->next_heap)
+    {
+        pthread_mutex_lock(&hh->slab_lock);
+    }
+}
+
+static
+void
+xmallocHlp_fork_release()
+{
+    for (heap* hh = fork_heaps; hh != NULL; hh = hh->next_heap)
+    {
+        pthread_mutex_unlock(&hh->slab_lock);
+    }
+
+    for (int ii = 0; ii < NUM_CLASSES; ++ii)
+    {
+        pthread_mutex_unlock(&depots[ii].lock);
+    }
+    pthread_mutex_unlock(&meta_lock);
+    pthread_mutex_unlock(&large_cache_lock);
+    xmallocHlp_pool_unlock_all();
+    pthread_mutex_unlock(&orphan_lock);
+    pthread_mutex_unlock(&purger_lock);
+}
+
+// The child has no purger thread, so it gets its own if the parent had
+// one, and its new threads start one from OPT_DECAY_MS as a program's
+// first ones do.
+static
+void
+xmallocHlp_fork_child()
+{
+    xmallocHlp_fork_release();
+    int had_purger = purger_running;
+    purger_running = 0;
+    purger_once = (pthread_once_t)PTHREAD_ONCE_INIT;
+    if (had_purger)
+    {
+        xmalloc_start_purger(atomic_load(&decay_ms));
+    }
+}
+
+static
+void
+xmallocHlp_init_fork()
+{
+    pthread_atfork(xmallocHlp_fork_prepare, xmallocHlp_fork_release, xmallocHlp_fork_child);
+}
+
+// Sets up the calling thread's heap on its first allocation, adopting one
+// left behind by an exited thread if there is one.
+static
+heap*
+xmallocHlp_get_heap()
+{
+    if (local_heap == NULL)
+    {
+        pthread_once(&heap_once, xmallocHlp_init);
+
+        pthread_mutex_lock(&orphan_lock);
+        heap* hh = orphan_heaps;
+        if (hh != NULL)
+        {
+            orphan_heaps = hh->next_orphan;
+        }
+        pthread_mutex_unlock(&orphan_lock);
+
+        if (hh == NULL)
+        {
+            size_t bytes = div_up(sizeof(heap), PAGE_SIZE) * PAGE_SIZE;
+            hh = mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                      MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+            assert(hh != MAP_FAILED);
+            stat_mapped(bytes / PAGE_SIZE);
+            atomic_init(&hh->remote_free, NULL);
+            pthread_mutex_init(&hh->slab_lock, 0);
+
+            hh->next_heap = atomic_load(&all_heaps);
+            while (!atomic_compare_exchange_weak(&all_heaps, &hh->next_heap, hh))
+            {
+            }
+        }
+
+        local_heap = hh;
+        pthread_setspecific(heap_key, hh);
+
+        // Registering can allocate, so wait until we have a heap to do it.
+        // Same for starting a thread.
+        pthread_once(&fork_once, xmallocHlp_init_fork);
+        pthread_once(&purger_once, purger_init);
+    }
+    return local_heap;
+}
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////// medium blocks ////////////////////////////
+
+// Each engine provides medium_insert (free a block, coalescing it),
+// medium_take (best/good fit), medium_add_span, medium_free_bytes and
+// medium_purge (release the pages inside free blocks).
+
+// Medium and large blocks start with a 16 byte header, so what they hand
+// out is 16 byte aligned like size class blocks: the block size (with
+// engine flags in the low bits, sizes being multiples of 16), then 0. A
+// block from xmalloc_aligned may start further in, past a header of its
+// own whose second word is how far back the real one is.
+#define HEADER_SIZE 16
+#define MEDIUM_FLAGS ((size_t)15)
+
+// Size of a medium or large block, from its header.
+static inline
+size_t
+header_size(void* bstart)
+{
+    return *((size_t*)bstart) & ~MEDIUM_FLAGS;
+}
+
+// How far a medium or large item is from the start of its block's data.
+static inline
+size_t
+header_back(void* item)
+{
+    return ((size_t*)item)[-1];
+}
+
+#ifdef OPT_TLSF
+
+#define TLSF_FREE      ((size_t)1) // this block is free
+#define TLSF_PREV_FREE ((size_t)2) // the block just before this one is free
+
+// A free block needs its node plus the footer.
+#define MEDIUM_MIN_FREE (div_up(sizeof(medium_node) + sizeof(size_t), 16) * 16)
+
+// Each span ends in a used block of this size, so the block before it
+// always has a header to its right, and nothing merges across spans.
+#define TLSF_SENTINEL 16
+
+// Which list a free block of the given size goes on.
+static inline
+void
+tlsf_mapping(size_t size, int* fl, int* sl)
+{
+    int bits = 63 - __builtin_clzl(size);
+    *fl = bits;
+    *sl = (int)(size >> (bits - TLSF_SL_BITS)) ^ TLSF_SL_COUNT;
+}
+
+static
+void
+tlsf_push(medium_index* mi, medium_node* node)
+{
+    size_t size = node->size & ~MEDIUM_FLAGS;
+    int fl, sl;
+    tlsf_mapping(size, &fl, &sl);
+
+    // footer, for the block to the right to find us, and tell it we're free
+    *((size_t*)((void*)node + size - sizeof(size_t))) = size;
+    *((size_t*)((void*)node + size)) |= TLSF_PREV_FREE;
+
+    node->prev_free = NULL;
+    node->next_free = mi->lists[fl][sl];
+    if (node->next_free != NULL)
+    {
+        node->next_free->prev_free = node;
+    }
+    mi->lists[fl][sl] = node;
+    mi->fl_bitmap |= 1u << fl;
+    mi->sl_bitmap[fl] |= 1u << sl;
+    stat_add(&mi->free_length, 1);
+}
+
+static
+void
+tlsf_remove(medium_index* mi, medium_node* node)
+{
+    int fl, sl;
+    tlsf_mapping(node->size & ~MEDIUM_FLAGS, &fl, &sl);
+
+    if (node->prev_free != NULL)
+    {
+        node->prev_free->next_free = node->next_free;
+    }
+    else
+    {
+        mi->lists[fl][sl] = node->next_free;
+        if (node->next_free == NULL)
+        {
+            mi->sl_bitmap[fl] &= ~(1u << sl);
+            if (mi->sl_bitmap[fl] == 0)
+            {
+                mi->fl_bitmap &= ~(1u << fl);
+            }
+        }
+    }
+    if (node->next_free != NULL)
+    {
+        node->next_free->prev_free = node->prev_free;
+    }
+    stat_add(&mi->free_length, -1);
+}
+
+// Frees a medium block (header holds its size), coalescing it with the
+// free blocks on either side of it first.
+static
+void
+medium_insert(medium_index* mi, medium_node* node)
+{
+    size_t size = node->size & ~MEDIUM_FLAGS;
+
+    medium_node* next = (medium_node*)((void*)node + size);
+    if (next->size & TLSF_FREE)
+    {
+        tlsf_remove(mi, next);
+        size += next->size & ~MEDIUM_FLAGS;
+    }
+
+    if (node->size & TLSF_PREV_FREE)
+    {
+        size_t prev_size = *((size_t*)((void*)node - sizeof(size_t)));
+        node = (medium_node*)((void*)node - prev_size);
+        tlsf_remove(mi, node);
+        size += prev_size;
+    }
+
+    // the block before a free block is never free itself
+    node->size = size | TLSF_FREE;
+    tlsf_push(mi, node);
+}
+
+// Removes and returns a free block of at least size bytes, or NULL if
+// there's none. Rounds size up to the next list boundary first, so any
+// block on the list found will do: no list is ever searched.
+static
+medium_node*
+medium_take(medium_index* mi, size_t size)
+{
+    int fl, sl;
+    tlsf_mapping(size, &fl, &sl);
+    tlsf_mapping(size + (1ul << (fl - TLSF_SL_BITS)) - 1, &fl, &sl);
+    if (fl >= TLSF_FL_COUNT)
+    {
+        return NULL;
+    }
+
+    uint32_t sl_map = mi->sl_bitmap[fl] & (~0u << sl);
+    if (sl_map == 0)
+    {
+        uint32_t fl_map = fl + 1 < 32 ? mi->fl_bitmap & (~0u << (fl + 1)) : 0;
+        if (fl_map == 0)
+        {
+            return NULL;
+        }
+        fl = __builtin_ctz(fl_map);
+        sl_map = mi->sl_bitmap[fl];
+    }
+    sl = __builtin_ctz(sl_map);
+
+    medium_node* node = mi->lists[fl][sl];
+    tlsf_remove(mi, node);
+
+    // It's a used block now, as far as its neighbours are concerned.
+    size_t bsize = node->size & ~MEDIUM_FLAGS;
+    node->size = bsize;
+    *((size_t*)((void*)node + bsize)) &= ~TLSF_PREV_FREE;
+    return node;
+}
+
+// Hands a freshly carved span over to the engine.
+static
+void
+medium_add_span(medium_index* mi, void* start, size_t bytes)
+{
+    size_t bsize = bytes - TLSF_SENTINEL;
+    *((size_t*)(start + bsize)) = TLSF_SENTINEL;
+
+    medium_node* node = (medium_node*)start;
+    node->size = bsize | TLSF_FREE;
+    tlsf_push(mi, node);
+}
+
+static
+size_t
+medium_free_bytes(medium_index* mi)
+{
+    size_t bytes = 0;
+    for (int fl = 0; fl < TLSF_FL_COUNT; ++fl)
+    {
+        for (int sl = 0; sl < TLSF_SL_COUNT; ++sl)
+        {
+            for (medium_node* node = mi->lists[fl][sl]; node != NULL; node = node->next_free)
+            {
+                bytes += node->size & ~MEDIUM_FLAGS;
+            }
+        }
+    }
+    return bytes;
+}
+
+// Releases the pages inside every free block, short of its node and footer.
+static
+long
+medium_purge(medium_index* mi, int now)
+{
+    long pages = 0;
+    for (int fl = 0; fl < TLSF_FL_COUNT; ++fl)
+    {
+        for (int sl = 0; sl < TLSF_SL_COUNT; ++sl)
+        {
+            for (medium_node* node = mi->lists[fl][sl]; node != NULL; node = node->next_free)
+            {
+                void* end = (void*)node + header_size(node) - sizeof(size_t);
+                pages += xmallocHlp_purge_pages(node + 1, end, now);
+            }
+        }
+    }
+    return pages;
+}
+
+#else
+
+// Free remainders smaller than a node stay with the block they were split from.
+#define MEDIUM_MIN_FREE (div_up(sizeof(medium_node), 16) * 16)
+
+// Picks how many levels a new node is linked on: each extra level with
+// probability 1/4, from a per heap xorshift generator.
+static
+long
+medium_random_level(medium_index* mi)
+{
+    uint64_t xx = mi->rng != 0 ? mi->rng : 0x9e3779b97f4a7c15;
+    xx ^= xx << 13;
+    xx ^= xx >> 7;
+    xx ^= xx << 17;
+    mi->rng = xx;
+
+    long levels = 1;
+    while (levels < MEDIUM_LEVELS && (xx & 3) == 0)
+    {
+        levels++;
+        xx >>= 2;
+    }
+    return levels;
+}
+
+// Fills prev[] with, for each level, the links (a node's or the heads) that
+// point at addr's place in the address list.
+static
+void
+medium_find_addr(medium_index* mi, void* addr, medium_node** prev[])
+{
+    medium_node** links = mi->by_addr;
+    for (long lv = MEDIUM_LEVELS - 1; lv >= 0; --lv)
+    {
+        while (links[lv] != NULL && (void*)links[lv] < addr)
+        {
+            links = links[lv]->by_addr;
+        }
+        prev[lv] = links;
+    }
+}
+
+// Same for (size, addr) in the size list.
+static
+void
+medium_find_size(medium_index* mi, size_t size, void* addr, medium_node** prev[])
+{
+    medium_node** links = mi->by_size;
+    for (long lv = MEDIUM_LEVELS - 1; lv >= 0; --lv)
+    {
+        while (links[lv] != NULL &&
+               (links[lv]->size < size || (links[lv]->size == size && (void*)links[lv] < addr)))
+        {
+            links = links[lv]->by_size;
+        }
+        prev[lv] = links;
+    }
+}
+
+// Adds node, which must not touch another free block, to both lists.
+static
+void
+medium_link(medium_index* mi, medium_node* node)
+{
+    medium_node** prev[MEDIUM_LEVELS];
+    node->levels = medium_random_level(mi);
+
+    medium_find_addr(mi, node, prev);
+    for (long lv = 0; lv < node->levels; ++lv)
+    {
+        node->by_addr[lv] = prev[lv][lv];
+        prev[lv][lv] = node;
+    }
+
+    medium_find_size(mi, node->size, node, prev);
+    for (long lv = 0; lv < node->levels; ++lv)
+    {
+        node->by_size[lv] = prev[lv][lv];
+        prev[lv][lv] = node;
+    }
+
+    stat_add(&mi->free_length, 1);
+}
+
+// Takes node off both lists.
+static
+void
+medium_unlink(medium_index* mi, medium_node* node)
+{
+    medium_node** prev[MEDIUM_LEVELS];
+
+    medium_find_addr(mi, node, prev);
+    for (long lv = 0; lv < node->levels; ++lv)
+    {
+        prev[lv][lv] = node->by_addr[lv];
+    }
+
+    medium_find_size(mi, node->size, node, prev);
+    for (long lv = 0; lv < node->levels; ++lv)
+    {
+        prev[lv][lv] = node->by_size[lv];
+    }
+
+    stat_add(&mi->free_length, -1);
+}
+
+// Frees a medium block (node->size set), coalescing it with the free
+// blocks on either side of it first.
+static
+void
+medium_insert(medium_index* mi, medium_node* node)
+{
+    medium_node** prev[MEDIUM_LEVELS];
+    medium_find_addr(mi, node, prev);
+
+    medium_node* next = prev[0][0];
+    medium_node* before = NULL;
+    if (prev[0] != mi->by_addr)
+    {
+        before = (medium_node*)((void*)prev[0] - offsetof(medium_node, by_addr));
+    }
+
+    if (next != NULL && (void*)node + node->size == (void*)next)
+    {
+        medium_unlink(mi, next);
+        node->size += next->size;
+    }
+
+    if (before != NULL && (void*)before + before->size == (void*)node)
+    {
+        medium_unlink(mi, before);
+        before->size += node->size;
+        node = before;
+    }
+
+    medium_link(mi, node);
+}
+
+// Removes and returns the smallest free block of at least size bytes
+// (the lowest addressed one on ties), or NULL if there's none.
+static
+medium_node*
+medium_take(medium_index* mi, size_t size)
+{
+    medium_node** links = mi->by_size;
+    for (long lv = MEDIUM_LEVELS - 1; lv >= 0; --lv)
+    {
+        while (links[lv] != NULL && links[lv]->size < size)
+        {
+            links = links[lv]->by_size;
+        }
+    }
+
+    medium_node* node = links[0];
+    if (node != NULL)
+    {
+        medium_unlink(mi, node);
+    }
+    return node;
+}
+
+// Hands a freshly carved span over to the engine.
+static
+void
+medium_add_span(medium_index* mi, void* start, size_t bytes)
+{
+    medium_node* node = (medium_node*)start;
+    node->size = bytes;
+    medium_insert(mi, node);
+}
+
+static
+size_t
+medium_free_bytes(medium_index* mi)
+{
+    size_t bytes = 0;
+    for (medium_node* node = mi->by_addr[0]; node != NULL; node = node->by_addr[0])
+    {
+        bytes += node->size;
+    }
+    return bytes;
+}
+
+// Releases the pages inside every free block, short of its node.
+static
+long
+medium_purge(medium_index* mi, int now)
+{
+    long pages = 0;
+    for (medium_node* node = mi->by_addr[0]; node != NULL; node = node->by_addr[0])
+    {
+        pages += xmallocHlp_purge_pages(node + 1, (void*)node + node->size, now);
+    }
+    return pages;
+}
+
+#endif
+
+static long slab_blocks[NUM_CLASSES]; // whole blocks in a slab of each class
+
+static
+void
+xmallocHlp_partial_unlink(size_class* sc, span* sp)
+{
+    if (sp->prev != NULL)
+    {
+        sp->prev->next = sp->next;
+    }
+    else
+    {
+        sc->partial = sp->next;
+    }
+    if (sp->next != NULL)
+    {
+        sp->next->prev = sp->prev;
+    }
+    sp->next = NULL;
+    sp->prev = NULL;
+}
+
+// Takes a free block of the class off the first slab that has one.
+static inline
+llist_node*
+xmallocHlp_slab_pop(size_class* sc)
+{
+    span* sp = sc->partial;
+    if (sp == NULL)
+    {
+        return NULL;
+    }
+
+    llist_node* node = sp->free_list;
+    sp->free_list = node->next;
+    if (--sp->free_count == 0)
+    {
+        xmallocHlp_partial_unlink(sc, sp);
+    }
+    stat_add(&sc->free_length, -1);
+    return node;
+}
+
+// Puts a size class block back on its slab, queueing the slab for purging
+// once all its blocks are free.
+static inline
+void
+xmallocHlp_slab_push(heap* hh, span* sp, llist_node* node)
+{
+    size_class* sc = &hh->classes[sp->cls];
+    node->next = sp->free_list;
+    sp->free_list = node;
+    if (sp->free_count++ == 0)
+    {
+        sp->next = sc->partial;
+        if (sc->partial != NULL)
+        {
+            sc->partial->prev = sp;
+        }
+        sc->partial = sp;
+    }
+    stat_add(&sc->free_length, 1);
+
+    if (sp->free_count == slab_blocks[sp->cls] && purge_enabled)
+    {
+        xmallocHlp_retire_slab(hh, sp);
+    }
+}
+
+// Puts a block owned by hh back where it came from. Size class blocks are
+// passed as is, medium blocks by their header.
+static
+void
+xmallocHlp_free_local(heap* hh, span* sp, llist_node* node)
+{
+    if (sp->cls >= 0)
+    {
+        xmallocHlp_slab_push(hh, sp, node);
+        if (--hh->purge_tick <= 0)
+        {
+            xmallocHlp_maybe_purge(hh);
+        }
+    }
+    else
+    {
+        medium_insert(&hh->medium, (medium_node*)node);
+    }
+}
+
+// Hands a block back to the heap that owns it, from another thread.
+static
+void
+xmallocHlp_free_remote(heap* owner, llist_node* node)
+{
+    LAT_PATH(OPT_LAT_FREE_REMOTE);
+    llist_node* head = atomic_load_explicit(&owner->remote_free, memory_order_relaxed);
+    do
+    {
+        node->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&owner->remote_free, &head, node,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+}
+
+// Takes back every block other threads have freed into hh since last time.
+static
+void
+xmallocHlp_drain_remote(heap* hh)
+{
+    llist_node* node = atomic_exchange_explicit(&hh->remote_free, NULL, memory_order_acquire);
+    while (node != NULL)
+    {
+        llist_node* next = node->next;
+        xmallocHlp_free_local(hh, pagemap_get(node), node);
+        node = next;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////////// magazines ////////////////////////////
+
+// Unless OPT_MAGAZINES=0, freed size class blocks go into magazines
+// first (after the per-CPU caches, if those are on), Bonwick style. Each
+// thread has a loaded and a previous magazine per class: a free pushes
+// onto the loaded one and an allocation pops off it, swapping the two
+// when it's full or empty. Only when both are full (or both empty) does
+// the thread go to the class's depot, trading a full magazine for an
+// empty one or the other way round, under the depot's lock. So a thread
+// never caches more than two magazines of a class, whatever it frees
+// stays reusable by the others, and blocks can change threads without a
+// remote free. When the depot is full, blocks go back to their owners.
+#define MAGAZINE_BYTES 4096
+#define MAGAZINE_MIN_ROUNDS 4
+#define MAGAZINE_MAX_ROUNDS 64
+#define DEPOT_MAX_FULL 16
+
+static int magazines_enabled = 1;
+static long mag_rounds[NUM_CLASSES];
+
+static
+void
+magazine_init()
+{
+    const char* env = getenv("OPT_MAGAZINES");
+    magazines_enabled = env == NULL || atoi(env) != 0;
+
+    for (int ii = 0; ii < NUM_CLASSES; ++ii)
+    {
+        long rounds = MAGAZINE_BYTES / class_sizes[ii];
+        rounds = rounds < MAGAZINE_MIN_ROUNDS ? MAGAZINE_MIN_ROUNDS : rounds;
+        mag_rounds[ii] = rounds > MAGAZINE_MAX_ROUNDS ? MAGAZINE_MAX_ROUNDS : rounds;
+    }
+}
+
+// An empty magazine, from the depot if it has one.
+static
+magazine*
+magazine_empty(int cls)
+{
+    depot* dd = &depots[cls];
+    pthread_mutex_lock(&dd->lock);
+    magazine* mag = dd->empty;
+    if (mag != NULL)
+    {
+        dd->empty = mag->next;
+    }
+    pthread_mutex_unlock(&dd->lock);
+
+    if (mag == NULL)
+    {
+        mag = meta_alloc(sizeof(magazine) + mag_rounds[cls] * sizeof(void*));
+    }
+    return mag;
+}
+
+// Loads the (empty) loaded magazine from the heap's own blocks.
+static
+magazine*
+magazine_fill(heap* hh, int cls)
+{
+    magazine* mag = hh->loaded[cls];
+    if (mag == NULL)
+    {
+        mag = magazine_empty(cls);
+        hh->loaded[cls] = mag;
+    }
+
+    if (atomic_load_explicit(&hh->remote_free, memory_order_relaxed) != NULL)
+    {
+        xmallocHlp_drain_remote(hh);
+    }
+    long count = 0;
+    while (count < mag_rounds[cls] && (mag->rounds[count] = xmallocHlp_class_alloc(hh, cls)) != NULL)
+    {
+        count += 1;
+    }
+    stat_set(&mag->count, count);
+    return mag;
+}
+
+// Gives every block in mag back to the heap that owns it.
+static
+void
+magazine_flush(heap* hh, magazine* mag)
+{
+    for (long ii = 0; ii < stat_get(&mag->count); ++ii)
+    {
+        llist_node* node = (llist_node*)mag->rounds[ii];
+        span* sp = pagemap_get(node);
+        if (sp->owner == hh)
+        {
+            xmallocHlp_free_local(hh, sp, node);
+        }
+        else
+        {
+            xmallocHlp_free_remote(sp->owner, node);
+        }
+    }
+    stat_set(&mag->count, 0);
+}
+
+// Both magazines are empty: trade the previous one for a full one from
+// the depot, or if it has none fill the loaded one from the heap.
+// Returns the new loaded magazine.
+static
+magazine*
+magazine_reload(heap* hh, int cls)
+{
+    magazine* prev = hh->previous[cls];
+    if (magazine_count(prev) > 0)
+    {
+        hh->previous[cls] = hh->loaded[cls];
+        hh->loaded[cls] = prev;
+        return prev;
+    }
+
+    depot* dd = &depots[cls];
+    magazine* full = NULL;
+    if (stat_get(&dd->full_count) == 0)
+    {
+        return magazine_fill(hh, cls);
+    }
+
+    pthread_mutex_lock(&dd->lock);
+    full = dd->full;
+    if (full != NULL)
+    {
+        dd->full = full->next;
+        atomic_fetch_sub(&dd->full_count, 1);
+        atomic_fetch_sub(&dd->blocks, stat_get(&full->count));
+        if (prev != NULL)
+        {
+            prev->next = dd->empty;
+            dd->empty = prev;
+        }
+    }
+    pthread_mutex_unlock(&dd->lock);
+
+    if (full == NULL)
+    {
+        return magazine_fill(hh, cls);
+    }
+    hh->previous[cls] = hh->loaded[cls];
+    hh->loaded[cls] = full;
+    return full;
+}
+
+// The loaded magazine is full (or missing): swap in the previous one if
+// it's empty, or else hand the previous one to the depot and take an
+// empty one. If the depot is full, the previous one is emptied into the
+// heaps instead. Returns the new loaded magazine.
+static
+magazine*
+magazine_unload(heap* hh, int cls)
+{
+    magazine* prev = hh->previous[cls];
+    if (hh->loaded[cls] == NULL || prev == NULL || stat_get(&prev->count) == 0)
+    {
+        if (prev == NULL)
+        {
+            prev = magazine_empty(cls);
+        }
+        hh->previous[cls] = hh->loaded[cls];
+        hh->loaded[cls] = prev;
+        return prev;
+    }
+
+    depot* dd = &depots[cls];
+    if (stat_get(&dd->full_count) >= DEPOT_MAX_FULL)
+    {
+        magazine_flush(hh, prev);
+        hh->previous[cls] = hh->loaded[cls];
+        hh->loaded[cls] = prev;
+        return prev;
+    }
+
+    pthread_mutex_lock(&dd->lock);
+    prev->next = dd->full;
+    dd->full = prev;
+    atomic_fetch_add(&dd->full_count, 1);
+    atomic_fetch_add(&dd->blocks, stat_get(&prev->count));
+    pthread_mutex_unlock(&dd->lock);
+
+    magazine* empty = magazine_empty(cls);
+    hh->previous[cls] = hh->loaded[cls];
+    hh->loaded[cls] = empty;
+    return empty;
+}
+
+static inline
+void*
+magazine_pop(heap* hh, int cls)
+{
+    magazine* mag = hh->loaded[cls];
+    if (magazine_count(mag) == 0)
+    {
+        mag = magazine_reload(hh, cls);
+    }
+
+    // Still empty: out of memory.
+    long count = stat_get(&mag->count);
+    if (count == 0)
+    {
+        return NULL;
+    }
+    stat_set(&mag->count, count - 1);
+    return mag->rounds[count - 1];
+}
+
+static inline
+void
+magazine_push(heap* hh, int cls, void* item)
+{
+    magazine* mag = hh->loaded[cls];
+    if (mag == NULL || stat_get(&mag->count) == mag_rounds[cls])
+    {
+        mag = magazine_unload(hh, cls);
+    }
+
+    long count = stat_get(&mag->count);
+    mag->rounds[count] = item;
+    stat_set(&mag->count, count + 1);
+}
+
+// An exiting thread's magazines go to the depot if it has room for them,
+// their blocks back to their owners otherwise.
+static
+void
+magazine_release(heap* hh)
+{
+    for (int cls = 0; cls < NUM_CLASSES; ++cls)
+    {
+        magazine* mags[2] = { hh->loaded[cls], hh->previous[cls] };
+        hh->loaded[cls] = NULL;
+        hh->previous[cls] = NULL;
+
+        depot* dd = &depots[cls];
+        for (int ii = 0; ii < 2; ++ii)
+        {
+            magazine* mag = mags[ii];
+            if (mag == NULL)
+            {
+                continue;
+            }
+
+            pthread_mutex_lock(&dd->lock);
+            if (stat_get(&mag->count) == 0 || stat_get(&dd->full_count) >= DEPOT_MAX_FULL)
+            {
+                pthread_mutex_unlock(&dd->lock);
+                magazine_flush(hh, mag);
+                pthread_mutex_lock(&dd->lock);
+                mag->next = dd->empty;
+                dd->empty = mag;
+            }
+            else
+            {
+                mag->next = dd->full;
+                dd->full = mag;
+                atomic_fetch_add(&dd->full_count, 1);
+                atomic_fetch_add(&dd->blocks, stat_get(&mag->count));
+            }
+            pthread_mutex_unlock(&dd->lock);
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////////// purging //////////////////////////////
+
+// Size class blocks never leave their slab, and each slab keeps its own
+// free blocks and their count, so the free that makes all of a slab's
+// blocks free sees it: the slab comes off its class right then and is
+// queued on the heap's dirty slabs. New slabs come from there first, so a
+// heap that keeps emptying and refilling slabs pays nothing for it. The
+// purger thread, if it's running, ages the dirty slabs; otherwise a heap
+// gives its own back (lazily) once they come to PURGE_MIN_BYTES, checking
+// every PURGE_INTERVAL frees. As the thread exits, and on xmalloc_trim(),
+// free medium blocks give back the pages inside them as well.
+// OPT_PURGE=0 in the environment leaves it all to xmalloc_trim(), which
+// then has to look for the slabs that are all free.
+#define PURGE_INTERVAL 4096 // frees onto a heap's lists between checks
+#define PURGE_MIN_BYTES (1024 * 1024)
+
+static int purge_enabled = 1;
+
+static
+void
+purge_init()
+{
+    const char* env = getenv("OPT_PURGE");
+    purge_enabled = env == NULL || atoi(env) != 0;
+
+    for (int ii = 0; ii < NUM_CLASSES; ++ii)
+    {
+        slab_blocks[ii] = SLAB_SIZE / class_sizes[ii];
+    }
+}
+
+// Takes a slab whose blocks are all free, which hh owns, off its class and
+// queues it on hh's dirty slabs. Nothing else has the slab's memory.
+static
+void
+xmallocHlp_retire_slab(heap* hh, span* sp)
+{
+    size_class* sc = &hh->classes[sp->cls];
+    xmallocHlp_partial_unlink(sc, sp);
+    stat_add(&sc->free_length, -sp->free_count);
+    sp->free_list = NULL;
+    sp->free_count = 0;
+    stat_add(&hh->stats.empty_slabs, 1);
+
+    pthread_mutex_lock(&hh->slab_lock);
+    sp->next = hh->dirty_slabs;
+    hh->dirty_slabs = sp;
+    stat_set(&hh->dirty_count, stat_get(&hh->dirty_count) + 1);
+    pthread_mutex_unlock(&hh->slab_lock);
+}
+
+// Gives back the pages of a list of slabs, then puts them on hh's empty
+// slabs. Returns the pages released.
+static
+long
+xmallocHlp_release_slabs(heap* hh, span* list, int now)
+{
+    if (list == NULL)
+    {
+        return 0;
+    }
+
+    long pages = 0;
+    span* last = list;
+    for (span* sp = list; sp != NULL; sp = sp->next)
+    {
+        pages += xmallocHlp_purge_pages(sp->start, sp->start + SLAB_SIZE, now);
+        last = sp;
+    }
+
+    pthread_mutex_lock(&hh->slab_lock);
+    last->next = hh->empty_slabs;
+    hh->empty_slabs = list;
+    pthread_mutex_unlock(&hh->slab_lock);
+    return pages;
+}
+
+// Gives back all of hh's dirty slabs, unless now is clear and the purger
+// is there to age them. Returns the pages released.
+static
+long
+xmallocHlp_release_dirty(heap* hh, int now)
+{
+    if (!now && purger_running)
+    {
+        return 0;
+    }
+
+    pthread_mutex_lock(&hh->slab_lock);
+    span* dirty = hh->dirty_slabs;
+    hh->dirty_slabs = NULL;
+    stat_set(&hh->dirty_count, 0);
+    pthread_mutex_unlock(&hh->slab_lock);
+    return xmallocHlp_release_slabs(hh, dirty, now);
+}
+
+// Queues the slabs of hh, which the caller owns, all of whose blocks are
+// free (only there with OPT_PURGE=0), and releases the dirty ones. This
+// walks the slabs with free blocks, so it's kept off the free path.
+// Returns the pages released.
+static
+long
+xmallocHlp_slab_purge(heap* hh, int now)
+{
+    for (int cls = 0; cls < NUM_CLASSES; ++cls)
+    {
+        span* next;
+        for (span* sp = hh->classes[cls].partial; sp != NULL; sp = next)
+        {
+            next = sp->next;
+            if (sp->free_count == slab_blocks[cls])
+            {
+                xmallocHlp_retire_slab(hh, sp);
+            }
+        }
+    }
+
+    long pages = xmallocHlp_release_dirty(hh, now);
+    stat_add(&hh->stats.pages_purged, pages);
+    stat_add(&hh->stats.purges, 1);
+    return pages;
+}
+
+// The medium blocks too, which aren't purged as a heap goes along: a free
+// block stays where it is, so it would be given back again every time.
+// With now set, the empty slabs hh already had are dropped right away as
+// well (see xmallocHlp_purge_pages).
+static
+long
+xmallocHlp_heap_purge(heap* hh, int now)
+{
+    long pages = 0;
+    if (now)
+    {
+        pthread_mutex_lock(&hh->slab_lock);
+        for (span* sp = hh->empty_slabs; sp != NULL; sp = sp->next)
+        {
+            pages += xmallocHlp_purge_pages(sp->start, sp->start + SLAB_SIZE, 1);
+        }
+        pthread_mutex_unlock(&hh->slab_lock);
+    }
+
+    pages += medium_purge(&hh->medium, now);
+    stat_add(&hh->stats.pages_purged, pages);
+    return pages + xmallocHlp_slab_purge(hh, now);
+}
+
+static
+void
+xmallocHlp_maybe_purge(heap* hh)
+{
+    hh->purge_tick = PURGE_INTERVAL;
+    if (!purger_running && stat_get(&hh->dirty_count) * SLAB_SIZE >= PURGE_MIN_BYTES)
+    {
+        long pages = xmallocHlp_release_dirty(hh, 0);
+        stat_add(&hh->stats.pages_purged, pages);
+        stat_add(&hh->stats.purges, 1);
+    }
+}
+
+// Only heaps without a running thread can be swept from outside: those
+// of other threads get blocks back through their remote lists, and sweep
+// themselves once they've taken enough of them. Per-CPU caches and pools
+// keep what they have.
+size_t
+xmalloc_trim()
+{
+    heap* hh = xmallocHlp_get_heap();
+    for (int cls = 0; cls < NUM_CLASSES; ++cls)
+    {
+        magazine* mags[2] = { hh->loaded[cls], hh->previous[cls] };
+        for (int ii = 0; ii < 2; ++ii)
+        {
+            if (mags[ii] != NULL)
+            {
+                magazine_flush(hh, mags[ii]);
+            }
+        }
+
+        depot* dd = &depots[cls];
+        pthread_mutex_lock(&dd->lock);
+        magazine* full = dd->full;
+        dd->full = NULL;
+        stat_set(&dd->full_count, 0);
+        stat_set(&dd->blocks, 0);
+        pthread_mutex_unlock(&dd->lock);
+
+        while (full != NULL)
+        {
+            magazine* mag = full;
+            full = mag->next;
+            magazine_flush(hh, mag);
+            pthread_mutex_lock(&dd->lock);
+            mag->next = dd->empty;
+            dd->empty = mag;
+            pthread_mutex_unlock(&dd->lock);
+        }
+    }
+
+    xmallocHlp_drain_remote(hh);
+    long pages = xmallocHlp_heap_purge(hh, 1);
+
+    pthread_mutex_lock(&orphan_lock);
+    for (heap* orphan = orphan_heaps; orphan != NULL; orphan = orphan->next_orphan)
+    {
+        xmallocHlp_drain_remote(orphan);
+        pages += xmallocHlp_heap_purge(orphan, 1);
+    }
+    pthread_mutex_unlock(&orphan_lock);
+
+    return pages * PAGE_SIZE + large_cache_trim(0);
+}
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////////// purger ///////////////////////////////
+
+// Optional (OPT_DECAY_MS in the environment, or xmalloc_start_purger()):
+// a thread that gives back dirty slabs and cached large spans as they
+// age, rather than right away. Giving pages back at once costs page
+// faults when the next spike wants them again, never giving them back
+// wastes them once it's over. So, as jemalloc does, of what became dirty
+// in each of the last DECAY_EPOCHS epochs of the decay time a smoothstep
+// of its age may stay dirty: all of it at first, none of it once it's
+// older than the decay time. The purger wakes up every epoch and gives
+// back whatever is over that, the oldest dirty slabs first, with
+// MADV_DONTNEED, as by then they aren't likely to be wanted soon. A
+// steady workload keeps reusing its slabs before they age out; an idle
+// one drains over the decay time.
+#define DECAY_MIN_EPOCH_MS 10
+#define PURGER_STACK_SIZE (64 * 1024) // it needs next to none, and address space may be tight
+
+static pthread_mutex_t purger_lock = PTHREAD_MUTEX_INITIALIZER; // held through each pass
+static pthread_once_t purger_once = PTHREAD_ONCE_INIT;
+static atomic_int purger_running = 0;
+static atomic_long decay_ms;
+static decay large_decay; // under large_cache_lock
+
+// Moves dd on by an epoch at whose end dirty are dirty. Returns how many
+// may stay so, which the caller then gives back the rest of.
+static
+long
+decay_advance(decay* dd, long dirty)
+{
+    memmove(&dd->backlog[1], &dd->backlog[0], (DECAY_EPOCHS - 1) * sizeof(long));
+    dd->backlog[0] = dirty > dd->last ? dirty - dd->last : 0;
+
+    double keep = 0;
+    for (int ii = 0; ii < DECAY_EPOCHS; ++ii)
+    {
+        double xx = (double)(DECAY_EPOCHS - ii) / DECAY_EPOCHS;
+        keep += dd->backlog[ii] * xx * xx * (3 - 2 * xx);
+    }
+    dd->last = dirty < (long)keep ? dirty : (long)keep;
+    return (long)keep;
+}
+
+static
+void
+purger_heap(heap* hh)
+{
+    pthread_mutex_lock(&hh->slab_lock);
+    long keep = decay_advance(&hh->decay, stat_get(&hh->dirty_count));
+    span** pp = &hh->dirty_slabs;
+    for (long ii = 0; ii < keep && *pp != NULL; ++ii)
+    {
+        pp = &(*pp)->next;
+    }
+    span* old = *pp;
+    *pp = NULL;
+    long count = 0;
+    for (span* sp = old; sp != NULL; sp = sp->next)
+    {
+        count += 1;
+    }
+    stat_set(&hh->dirty_count, stat_get(&hh->dirty_count) - count);
+    pthread_mutex_unlock(&hh->slab_lock);
+
+    atomic_fetch_add(&purger_pages, xmallocHlp_release_slabs(hh, old, 1));
+}
+
+static
+void
+purger_large()
+{
+    pthread_mutex_lock(&large_cache_lock);
+    long keep = decay_advance(&large_decay, large_cache_bytes / PAGE_SIZE);
+    pthread_mutex_unlock(&large_cache_lock);
+
+    atomic_fetch_add(&purger_bytes_unmapped, large_cache_trim(keep * PAGE_SIZE));
+}
+
+static
+void*
+purger_main(void* arg)
+{
+    // Signals are for the program's own threads.
+    sigset_t all;
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, NULL);
+
+    for (;;)
+    {
+        long epoch = atomic_load(&decay_ms) / DECAY_EPOCHS;
+        epoch = epoch < DECAY_MIN_EPOCH_MS ? DECAY_MIN_EPOCH_MS : epoch;
+        struct timespec ts = { epoch / 1000, (epoch % 1000) * 1000000 };
+        nanosleep(&ts, NULL);
+
+        pthread_mutex_lock(&purger_lock);
+        for (heap* hh = atomic_load(&all_heaps); hh != NULL; hh = hh->next_heap)
+        {
+            purger_heap(hh);
+        }
+        purger_large();
+        atomic_fetch_add(&purger_passes, 1);
+        pthread_mutex_unlock(&purger_lock);
+    }
+    return NULL;
+}
+
+int
+xmalloc_start_purger(long ms)
+{
+    assert(ms > 0);
+    atomic_store(&decay_ms, ms);
+
+    int rv = 0;
+    pthread_mutex_lock(&purger_lock);
+    if (!purger_running)
+    {
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        pthread_attr_setstacksize(&attr, PURGER_STACK_SIZE);
+        rv = pthread_create(&thread, &attr, purger_main, NULL);
+        pthread_attr_destroy(&attr);
+        purger_running = rv == 0;
+    }
+    pthread_mutex_unlock(&purger_lock);
+    return rv;
+}
+
+static
+void
+purger_init()
+{
+    const char* env = getenv("OPT_DECAY_MS");
+    if (env != NULL && atol(env) > 0)
+    {
+        xmalloc_start_purger(atol(env));
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////////// xmalloc //////////////////////////////
+
+// Adds a new medium span to hh: a whole one, or what's left of the chunk
+// (always a whole number of slabs) if that's less. What's left may be too
+// small for the request, but then the next span is a whole one. Returns 0
+// if there's no memory for it.
+static
+int
+xmallocHlp_medium_grow(heap* hh)
+{
+    LAT_PATH(OPT_LAT_ALLOC_CARVE);
+    size_t bytes = hh->chunk_end - hh->chunk_next;
+    if (bytes == 0 || bytes > MEDIUM_SPAN_SIZE)
+    {
+        bytes = MEDIUM_SPAN_SIZE;
+    }
+    void* start = xmallocHlp_new_span(hh, -1, bytes);
+    if (start == NULL)
+    {
+        return 0;
+    }
+    medium_add_span(&hh->medium, start, bytes);
+    return 1;
+}
+
+// Starts carving a class out of a new slab, an empty one if there is one.
+// Returns 0 if there's no memory for one.
+static
+int
+xmallocHlp_new_slab(heap* hh, int cls)
+{
+    size_class* sc = &hh->classes[cls];
+    void* start;
+
+    pthread_mutex_lock(&hh->slab_lock);
+    span* sp = hh->dirty_slabs;
+    if (sp != NULL)
+    {
+        hh->dirty_slabs = sp->next;
+        stat_set(&hh->dirty_count, stat_get(&hh->dirty_count) - 1);
+    }
+    else if ((sp = hh->empty_slabs) != NULL)
+    {
+        hh->empty_slabs = sp->next;
+    }
+    pthread_mutex_unlock(&hh->slab_lock);
+
+    if (sp != NULL)
+    {
+        stat_add(&hh->stats.empty_slabs, -1);
+        sp->cls = cls;
+        start = sp->start;
+    }
+    else if ((start = xmallocHlp_new_span(hh, cls, SLAB_SIZE)) == NULL)
+    {
+        return 0;
+    }
+    size_t bsize = class_sizes[cls];
+    sc->slab_next = start;
+    sc->slab_end = start + (SLAB_SIZE / bsize) * bsize;
+    return 1;
+}
+
+static
+void*
+xmallocHlp_class_alloc(heap* hh, int cls)
+{
+    size_class* sc = &hh->classes[cls];
+
+    llist_node* node = xmallocHlp_slab_pop(sc);
+    if (node != NULL)
+    {
+        return node;
+    }
+
+    LAT_PATH(OPT_LAT_ALLOC_CARVE);
+    if (sc->slab_next == sc->slab_end && !xmallocHlp_new_slab(hh, cls))
+    {
+        return NULL;
+    }
+
+    void* block = sc->slab_next;
+    sc->slab_next += class_sizes[cls];
+    return block;
+}
+
+// Pops a block off a size class, from this CPU's cache if there is one.
+// No header: the page map knows which class the slab belongs to.
+static inline
+void*
+xmallocHlp_small_pop(heap* hh, int cls)
+{
+    if (percpu_enabled)
+    {
+        void* item = percpu_pop(cls);
+        if (item != NULL)
+        {
+            return item;
+        }
+    }
+
+    if (magazines_enabled)
+    {
+        return magazine_pop(hh, cls);
+    }
+
+    // Blocks other threads freed back to us are reused before anything else.
+    if (atomic_load_explicit(&hh->remote_free, memory_order_relaxed) != NULL)
+    {
+        xmallocHlp_drain_remote(hh);
+    }
+    return xmallocHlp_class_alloc(hh, cls);
+}
+
+static inline
+void*
+xmallocHlp_small_alloc(heap* hh, int cls)
+{
+    LAT_SIZE(OPT_LAT_SMALL);
+    void* item = xmallocHlp_small_pop(hh, cls);
+    if (item == NULL)
+    {
+        return NULL;
+    }
+    stat_add(&hh->stats.class_allocs[cls], 1);
+    stat_add(&hh->stats.bytes_allocated, class_sizes[cls]);
+    return item;
+}
+
+// Pages for a large block, reusing a recently freed span if one fits.
+// Sets *zeroed if they're fresh from the kernel, and so still all zero.
+// Returns NULL if the kernel has none to give.
+static
+void*
+xmallocHlp_large_alloc(size_t num_pages, int* zeroed)
+{
+    LAT_SIZE(OPT_LAT_LARGE);
+    void* bstart = large_cache_take(num_pages);
+    *zeroed = bstart == NULL;
+    if (bstart == NULL)
+    {
+        LAT_PATH(OPT_LAT_ALLOC_MMAP);
+        bstart = xmallocHlp_map(num_pages * PAGE_SIZE);
+        if (bstart != NULL)
+        {
+            stat_mapped(num_pages);
+        }
+    }
+    return bstart;
+}
+
+// Sets *zeroed if the block is known to be all zero, which is only ever
+// a large one fresh from the kernel: size class and medium blocks come
+// out of slabs and spans whose pages may have been used before, and
+// tracking which weren't would cost every allocation for calloc's sake.
+// Returns NULL when out of memory.
+static inline
+void*
+xmallocHlp_block(heap* hh, size_t size, int* zeroed)
+{
+    // For requests of <= 2048 bytes, pop a block off the matching size class.
+    if (size <= HALF_PAGE_SIZE)
+    {
+        return xmallocHlp_small_alloc(hh, size_to_class(size));
+    }
+
+    if (atomic_load_explicit(&hh->remote_free, memory_order_relaxed) != NULL)
+    {
+        xmallocHlp_drain_remote(hh);
+    }
+
+    // Bigger blocks use the start of the block to store its size.
+    // Return a pointer to the block after the header.
+    // Sizes are kept at multiples of 16 so any leftover stays aligned.
+    size = div_up(size + HEADER_SIZE, 16) * 16;
+    void* new_bstart;
+    size_t new_bsize;
+
+    // Requests with (2048 < B < 16K): take the best fitting free block
+    if (size < MEDIUM_MAX)
+    {
+        LAT_SIZE(OPT_LAT_MEDIUM);
+        medium_node* node = medium_take(&hh->medium, size);
+        while (node == NULL) // If you don’t have a block, carve a new span and take it from that
+        {
+            if (!xmallocHlp_medium_grow(hh))
+            {
+                return NULL;
+            }
+            node = medium_take(&hh->medium, size);
+        }
+        new_bstart = (void*)node;
+        new_bsize = header_size(node);
+
+        // If the block is bigger than the request, and the leftover is big enough to
+        // hold a free node, give the extra back.
+        if (new_bsize - size >= MEDIUM_MIN_FREE)
+        {
+            medium_node* rest = (medium_node*)(new_bstart + size);
+            rest->size = new_bsize - size;
+            medium_insert(&hh->medium, rest);
+            new_bsize = size;
+        }
+    }
+    else // Requests with (B >= 16K):
+    {
+        size_t num_pages = div_up(size, PAGE_SIZE); // Calculate the number of pages needed for this block.
+        new_bsize = PAGE_SIZE * num_pages; // // Allocate that many pages
+        new_bstart = xmallocHlp_large_alloc(num_pages, zeroed);
+        if (new_bstart == NULL)
+        {
+            return NULL;
+        }
+    }
+    stat_add(&hh->stats.bytes_allocated, new_bsize);
+    ((size_t*)new_bstart)[0] = new_bsize;
+    ((size_t*)new_bstart)[1] = 0;
+    return new_bstart + HEADER_SIZE;
+}
+
+// Sizes over MAX_SIZE are never there, and aren't counted.
+static inline
+void*
+xmallocHlp_malloc(size_t size, int* zeroed)
+{
+    *zeroed = 0;
+    if (size > MAX_SIZE)
+    {
+        return NULL;
+    }
+
+    heap* hh = xmallocHlp_get_heap();
+    void* item = xmallocHlp_block(hh, size, zeroed);
+    if (item != NULL)
+    {
+        stat_add(&hh->stats.allocs, 1);
+    }
+    return item;
+}
+
+void*
+xmalloc(size_t size)
+{
+#ifdef OPT_LATENCY
+    uint64_t start = lat_now();
+    LAT_PATH(OPT_LAT_ALLOC_FREELIST);
+    int zeroed;
+    void* item = xmallocHlp_malloc(size, &zeroed);
+    lat_done(start);
+    return item;
+#else
+    int zeroed;
+    return xmallocHlp_malloc(size, &zeroed);
+#endif
+}
+
+// Large blocks fresh from mmap are zero already, and aren't cleared,
+// which saves touching every page. Everything else is: large blocks from
+// the span cache, and size class and medium blocks (at most 16K), fresh
+// or not.
+static inline
+void*
+xmallocHlp_calloc(size_t bytes)
+{
+    int zeroed;
+    void* item = xmallocHlp_malloc(bytes, &zeroed);
+    if (item != NULL && !zeroed)
+    {
+        memset(item, 0, bytes);
+    }
+    return item;
+}
+
+void*
+xcalloc(size_t nmemb, size_t size)
+{
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+    {
+        return NULL;
+    }
+
+#ifdef OPT_LATENCY
+    uint64_t start = lat_now();
+    LAT_PATH(OPT_LAT_ALLOC_FREELIST);
+    void* item = xmallocHlp_calloc(bytes);
+    lat_done(start);
+    return item;
+#else
+    return xmallocHlp_calloc(bytes);
+#endif
+}
+
+static
+void
+xmallocHlp_free_large(heap* hh, void* bstart, size_t bsize)
+{
+    stat_add(&hh->stats.bytes_freed, bsize);
+    LAT_SIZE(OPT_LAT_LARGE);
+
+    // Keep the span around for the next large request, unless the cache is full
+    if (!large_cache_put(bstart, bsize))
+    {
+        LAT_PATH(OPT_LAT_FREE_UNMAP);
+        int rv = munmap(bstart, bsize); // then munmap it.
+        assert(rv == 0);
+        stat_unmapped(bsize / PAGE_SIZE);
+    }
+}
+
+static inline
+void
+xmallocHlp_free(void* item)
+{
+    if (item == NULL)
+    {
+        return;
+    }
+
+    heap* hh = xmallocHlp_get_heap();
+    stat_add(&hh->stats.frees, 1);
+
+    // If the block is in a slab, it goes back to the heap of the thread that
+    // allocated it. That's a plain list push (size class) or insert (medium)
+    // if it's ours, or a push onto the owner's remote free stack otherwise.
+    span* sp = pagemap_get(item);
+    if (sp != NULL)
+    {
+        llist_node* node;
+        if (sp->cls >= 0)
+        {
+            LAT_SIZE(OPT_LAT_SMALL);
+            stat_add(&hh->stats.class_frees[sp->cls], 1);
+            stat_add(&hh->stats.bytes_freed, class_sizes[sp->cls]);
+            if (percpu_enabled && percpu_push(sp->cls, item))
+            {
+                return;
+            }
+            if (magazines_enabled)
+            {
+                magazine_push(hh, sp->cls, item);
+                return;
+            }
+            node = (llist_node*)item;
+        }
+        else
+        {
+            LAT_SIZE(OPT_LAT_MEDIUM);
+            item -= header_back(item);
+            node = (llist_node*)(item - HEADER_SIZE);
+            stat_add(&hh->stats.bytes_freed, header_size(node));
+        }
+
+        if (sp->owner == local_heap)
+        {
+            xmallocHlp_free_local(sp->owner, sp, node);
+        }
+        else
+        {
+            xmallocHlp_free_remote(sp->owner, node);
+        }
+        return;
+    }
+
+    // Otherwise it's a large block, with its size in the header.
+    item -= header_back(item);
+    void* bstart = item - HEADER_SIZE;
+    xmallocHlp_free_large(hh, bstart, *((size_t*)bstart));
+}
+
+void
+xfree(void* item)
+{
+#ifdef OPT_LATENCY
+    if (item == NULL)
+    {
+        return;
+    }
+    uint64_t start = lat_now();
+    LAT_PATH(OPT_LAT_FREE_LOCAL);
+    xmallocHlp_free(item);
+    lat_done(start);
+#else
+    xmallocHlp_free(item);
+#endif
+}
+
+// Where a block from xmalloc_aligned(align, size) is, by the same
+// choices xmallocHlp_aligned makes (align 16 for xmalloc(size)): the
+// first class that's a multiple of align is that of size rounded up to
+// align, and a large block's item is min(align, a page) bytes in. Sets
+// *cls (-1 if not small), or the large block's *bstart and *bsize
+// (*bstart NULL if it's medium).
+static inline
+void
+xmallocHlp_sized_block(void* item, size_t align, size_t size, int* cls, void** bstart, size_t* bsize)
+{
+    size_t rounded = align <= 16 ? size : div_up(size == 0 ? 1 : size, align) * align;
+    *cls = rounded <= HALF_PAGE_SIZE ? size_to_class(rounded) : -1;
+    *bstart = NULL;
+    if (*cls >= 0)
+    {
+        return;
+    }
+
+    size_t need = div_up(size + HEADER_SIZE, 16) * 16;
+    size_t lead = align <= 16 ? HEADER_SIZE : align < PAGE_SIZE ? align : PAGE_SIZE;
+    if (align <= 16 ? need >= MEDIUM_MAX : need + align + MEDIUM_MIN_FREE >= MEDIUM_MAX)
+    {
+        *bstart = item - lead;
+        *bsize = div_up(need + (align <= 16 ? 0 : lead), PAGE_SIZE) * PAGE_SIZE;
+    }
+}
+
+#ifdef OPT_DEBUG
+// Checks that align and size are what the block was last asked for, as
+// far as its metadata can tell.
+static
+void
+xmallocHlp_check_sized(void* item, size_t align, size_t size)
+{
+    int cls;
+    void* bstart;
+    size_t bsize;
+    xmallocHlp_sized_block(item, align, size, &cls, &bstart, &bsize);
+
+    span* sp = pagemap_get(item);
+    if (cls >= 0)
+    {
+        assert(sp != NULL && sp->cls == cls);
+    }
+    else if (bstart == NULL)
+    {
+        size_t back = header_back(item);
+        assert(sp != NULL && sp->cls < 0);
+        assert(header_size(item - back - HEADER_SIZE) >= div_up(size + HEADER_SIZE, 16) * 16 + back);
+    }
+    else
+    {
+        assert(sp == NULL);
+        assert(item - header_back(item) - HEADER_SIZE == bstart);
+        assert(header_size(bstart) == bsize);
+    }
+}
+#endif
+
+// The size says which class a small block is in, so it goes straight
+// into a per-CPU cache or a magazine without a page map lookup (with
+// both off, the lookup still finds its owner), and how many pages a large
+// block has, so its header isn't read. Medium blocks need their header
+// (and owner) anyway and take the xfree path.
+static inline
+void
+xmallocHlp_free_sized(void* item, size_t align, size_t size)
+{
+#ifdef OPT_DEBUG
+    xmallocHlp_check_sized(item, align, size);
+#endif
+
+    int cls;
+    void* bstart;
+    size_t bsize;
+    xmallocHlp_sized_block(item, align, size, &cls, &bstart, &bsize);
+
+    if (cls >= 0)
+    {
+        LAT_SIZE(OPT_LAT_SMALL);
+        heap* hh = xmallocHlp_get_heap();
+        stat_add(&hh->stats.frees, 1);
+        stat_add(&hh->stats.class_frees[cls], 1);
+        stat_add(&hh->stats.bytes_freed, class_sizes[cls]);
+        if (percpu_enabled && percpu_push(cls, item))
+        {
+            return;
+        }
+        if (magazines_enabled)
+        {
+            magazine_push(hh, cls, item);
+            return;
+        }
+
+        span* sp = pagemap_get(item);
+        if (sp->owner == hh)
+        {
+            xmallocHlp_free_local(hh, sp, (llist_node*)item);
+        }
+        else
+        {
+            xmallocHlp_free_remote(sp->owner, (llist_node*)item);
+        }
+    }
+    else if (bstart != NULL)
+    {
+        heap* hh = xmallocHlp_get_heap();
+        stat_add(&hh->stats.frees, 1);
+        xmallocHlp_free_large(hh, bstart, bsize);
+    }
+    else
+    {
+        xmallocHlp_free(item);
+    }
+}
+
+void
+xfree_sized(void* item, size_t size)
+{
+    if (item == NULL)
+    {
+        return;
+    }
+
+#ifdef OPT_LATENCY
+    uint64_t start = lat_now();
+    LAT_PATH(OPT_LAT_FREE_LOCAL);
+    xmallocHlp_free_sized(item, 16, size);
+    lat_done(start);
+#else
+    xmallocHlp_free_sized(item, 16, size);
+#endif
+}
+
+void
+xfree_aligned_sized(void* item, size_t align, size_t size)
+{
+    if (item == NULL)
+    {
+        return;
+    }
+
+#ifdef OPT_LATENCY
+    uint64_t start = lat_now();
+    LAT_PATH(OPT_LAT_FREE_LOCAL);
+    xmallocHlp_free_sized(item, align, size);
+    lat_done(start);
+#else
+    xmallocHlp_free_sized(item, align, size);
+#endif
+}
+
+void *
+xrealloc(void *item, size_t size) {
+
+    // if you're trying to reallocate the head,
+    // you are trying to realloc the entire list
+    if (item == NULL) {
+        return xmalloc(size);
+    }
+    if (size > MAX_SIZE) {
+        return NULL;
+    }
+
+    // A size class block stays put if the new size is in the same class.
+    // Otherwise it moves, even when it would fit, so that the class of a
+    // small block is always that of the size last asked for (xfree_sized).
+    span* sp = pagemap_get(item);
+    if (sp != NULL && sp->cls >= 0) {
+        size_t csize = class_sizes[sp->cls];
+        if (size <= HALF_PAGE_SIZE && size_to_class(size) == sp->cls) {
+            return item;
+        }
+
+        void* new_ptr = xmalloc(size);
+        if (new_ptr == NULL) {
+            return NULL;
+        }
+        memcpy(new_ptr, item, csize < size ? csize : size);
+        xfree(item);
+        return new_ptr;
+    }
+
+    // size of memory block to realloc, header included
+    size_t back = header_back(item);
+    void* bstart = item - back - HEADER_SIZE;
+    size_t bsize = header_size(bstart) - back;
+
+    // A large block that stays large is resized by the kernel: mremap moves
+    // page table entries instead of copying bytes, and shrinking hands the
+    // tail pages back. Either way it costs O(pages), not O(bytes).
+    size_t need = div_up(size + HEADER_SIZE, 16) * 16;
+    if (sp == NULL && need >= MEDIUM_MAX && back == 0) {
+        size_t new_bsize = div_up(need, PAGE_SIZE) * PAGE_SIZE;
+        if (new_bsize > bsize) {
+            // On failure the old mapping is left as it was.
+            void* moved = mremap(bstart, bsize, new_bsize, MREMAP_MAYMOVE);
+            if (moved == MAP_FAILED) {
+                return NULL;
+            }
+            bstart = moved;
+            stat_mapped((new_bsize - bsize) / PAGE_SIZE);
+        }
+        else if (new_bsize < bsize) {
+            int rv = munmap(bstart + new_bsize, bsize - new_bsize);
+            assert(rv == 0);
+            stat_unmapped((bsize - new_bsize) / PAGE_SIZE);
+        }
+
+        stat_add(&xmallocHlp_get_heap()->stats.bytes_allocated, new_bsize - bsize);
+        *((size_t*)bstart) = new_bsize;
+        return bstart + HEADER_SIZE;
+    }
+
+    // a medium block that already has room (and stays medium)
+    if (sp != NULL && need <= bsize && size > HALF_PAGE_SIZE) {
+        return item;
+    }
+
+    // allocate new memory, keeping the old block if there's none
+    void* new_ptr = xmalloc(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+
+    // copy old memory to new memory (a large block moving down to a
+    // smaller one only keeps what fits)
+    size_t keep = bsize - HEADER_SIZE;
+    memcpy(new_ptr, item, keep < size ? keep : size);
+
+    // free old memory
+    xfree(item);
+
+    return new_ptr;
+}
+
+size_t
+xmalloc_usable_size(void* item)
+{
+    if (item == NULL)
+    {
+        return 0;
+    }
+
+    span* sp = pagemap_get(item);
+    if (sp != NULL && sp->cls >= 0)
+    {
+        return class_sizes[sp->cls];
+    }
+
+    size_t back = header_back(item);
+    return header_size(item - back - HEADER_SIZE) - back - HEADER_SIZE;
+}
+
+// Medium blocks are trimmed to the aligned address, with the bytes in
+// front of it given back, so the block has a header of its own right
+// before it. A large block starts a page before the aligned address, the
+// word before which tells xfree how far back its header is.
+static
+void*
+xmallocHlp_medium_aligned(heap* hh, size_t align, size_t size)
+{
+    LAT_SIZE(OPT_LAT_MEDIUM);
+    medium_node* node = medium_take(&hh->medium, size + align + MEDIUM_MIN_FREE);
+    while (node == NULL)
+    {
+        if (!xmallocHlp_medium_grow(hh))
+        {
+            return NULL;
+        }
+        node = medium_take(&hh->medium, size + align + MEDIUM_MIN_FREE);
+    }
+
+    // Whatever is in front has to be big enough to be a free block.
+    void* bstart = (void*)node;
+    uintptr_t item = ((uintptr_t)bstart + HEADER_SIZE + align - 1) & ~(uintptr_t)(align - 1);
+    size_t lead = item - HEADER_SIZE - (uintptr_t)bstart;
+    if (lead != 0 && lead < MEDIUM_MIN_FREE)
+    {
+        lead += div_up(MEDIUM_MIN_FREE - lead, align) * align;
+    }
+    void* new_bstart = bstart + lead;
+    size_t new_bsize = header_size(node) - lead;
+    size_t tail = new_bsize - size >= MEDIUM_MIN_FREE ? new_bsize - size : 0;
+    new_bsize -= tail;
+
+    // The header goes first: giving the lead back marks it (TLSF_PREV_FREE).
+    ((size_t*)new_bstart)[0] = new_bsize;
+    ((size_t*)new_bstart)[1] = 0;
+    if (tail != 0)
+    {
+        medium_node* rest = (medium_node*)(new_bstart + new_bsize);
+        rest->size = tail;
+        medium_insert(&hh->medium, rest);
+    }
+    if (lead != 0)
+    {
+        node->size = lead;
+        medium_insert(&hh->medium, node);
+    }
+
+    stat_add(&hh->stats.bytes_allocated, new_bsize);
+    return new_bstart + HEADER_SIZE;
+}
+
+// Large pages start on a page, so up to a page of alignment the item
+// just goes align bytes in, leaving room for the header. Past a page, map
+// enough to find an aligned spot a page in and cut off the rest.
+static
+void*
+xmallocHlp_large_aligned(heap* hh, size_t align, size_t size)
+{
+    size_t lead = align < PAGE_SIZE ? align : PAGE_SIZE;
+    size_t num_pages = div_up(size + lead, PAGE_SIZE); // so even a 0 byte item is inside
+    size_t bsize = num_pages * PAGE_SIZE;
+    void* bstart;
+
+    if (align <= PAGE_SIZE)
+    {
+        int zeroed;
+        bstart = xmallocHlp_large_alloc(num_pages, &zeroed);
+        if (bstart == NULL)
+        {
+            return NULL;
+        }
+    }
+    else
+    {
+        LAT_SIZE(OPT_LAT_LARGE);
+        LAT_PATH(OPT_LAT_ALLOC_MMAP);
+        size_t map_bytes = bsize + align - PAGE_SIZE;
+        void* mem = xmallocHlp_map(map_bytes);
+        if (mem == NULL)
+        {
+            return NULL;
+        }
+        uintptr_t item = ((uintptr_t)mem + PAGE_SIZE + align - 1) & ~(uintptr_t)(align - 1);
+        bstart = (void*)(item - PAGE_SIZE);
+        if (bstart != mem)
+        {
+            int rv = munmap(mem, bstart - mem);
+            assert(rv == 0);
+        }
+        if (bstart + bsize != mem + map_bytes)
+        {
+            int rv = munmap(bstart + bsize, (mem + map_bytes) - (bstart + bsize));
+            assert(rv == 0);
+        }
+        stat_mapped(num_pages);
+    }
+
+    stat_add(&hh->stats.bytes_allocated, bsize);
+    ((size_t*)bstart)[0] = bsize;
+    ((size_t*)bstart)[1] = 0;
+    void* item = bstart + lead;
+    ((size_t*)item)[-1] = lead - HEADER_SIZE;
+    return item;
+}
+
+// The padding for align is at most align plus a page, so asking for no
+// more than MAX_SIZE of either keeps sizes from wrapping.
+static
+void*
+xmallocHlp_aligned(heap* hh, size_t align, size_t size)
+{
+    // Slabs start on a page, so every block of a class whose size is a
+    // multiple of align is aligned: take the first such class that fits.
+    if (size <= HALF_PAGE_SIZE && align <= PAGE_SIZE)
+    {
+        for (int cls = size_to_class(size); cls < NUM_CLASSES; ++cls)
+        {
+            if (class_sizes[cls] % align == 0)
+            {
+                return xmallocHlp_small_alloc(hh, cls);
+            }
+        }
+    }
+
+    if (atomic_load_explicit(&hh->remote_free, memory_order_relaxed) != NULL)
+    {
+        xmallocHlp_drain_remote(hh);
+    }
+
+    // A medium block has to be able to hold a free node once it's freed.
+    size = div_up(size + HEADER_SIZE, 16) * 16;
+    if (size + align + MEDIUM_MIN_FREE < MEDIUM_MAX)
+    {
+        return xmallocHlp_medium_aligned(hh, align, size > MEDIUM_MIN_FREE ? size : MEDIUM_MIN_FREE);
+    }
+    return xmallocHlp_large_aligned(hh, align, size);
+}
+
+void*
+xmalloc_aligned(size_t align, size_t size)
+{
+    assert(align != 0 && (align & (align - 1)) == 0);
+    if (align <= 16)
+    {
+        return xmalloc(size);
+    }
+    if (size > MAX_SIZE || align > MAX_SIZE)
+    {
+        return NULL;
+    }
+
+    heap* hh = xmallocHlp_get_heap();
+    void* item = xmallocHlp_aligned(hh, align, size);
+    if (item != NULL)
+    {
+        stat_add(&hh->stats.allocs, 1);
+    }
+    return item;
+}
+
+/////////////////////////////////////////////////////////////////////
+/////////////////////////////// batches /////////////////////////////
+
+// Small blocks come off the class's free list and then the slab, as many
+// at a time as it has, with the stats counted once for the whole batch.
+void
+xmalloc_batch(size_t size, size_t count, void** out)
+{
+    if (size > HALF_PAGE_SIZE)
+    {
+        for (size_t ii = 0; ii < count; ++ii)
+        {
+            out[ii] = xmalloc(size);
+        }
+        return;
+    }
+
+    heap* hh = xmallocHlp_get_heap();
+    int cls = size_to_class(size);
+    size_class* sc = &hh->classes[cls];
+    size_t bsize = class_sizes[cls];
+    stat_add(&hh->stats.allocs, count);
+    stat_add(&hh->stats.class_allocs[cls], count);
+    stat_add(&hh->stats.bytes_allocated, count * bsize);
+
+    if (atomic_load_explicit(&hh->remote_free, memory_order_relaxed) != NULL)
+    {
+        xmallocHlp_drain_remote(hh);
+    }
+
+    size_t ii = 0;
+    while (ii < count && sc->partial != NULL)
+    {
+        span* sp = sc->partial;
+        long taken = 0;
+        llist_node* node = sp->free_list;
+        while (ii < count && node != NULL)
+        {
+            out[ii++] = node;
+            node = node->next;
+            taken += 1;
+        }
+        sp->free_list = node;
+        sp->free_count -= taken;
+        if (node == NULL)
+        {
+            xmallocHlp_partial_unlink(sc, sp);
+        }
+        stat_add(&sc->free_length, -taken);
+    }
+
+    while (ii < count)
+    {
+        if (sc->slab_next == sc->slab_end && !xmallocHlp_new_slab(hh, cls))
+        {
+            break;
+        }
+        while (ii < count && sc->slab_next != sc->slab_end)
+        {
+            out[ii++] = sc->slab_next;
+            sc->slab_next += bsize;
+        }
+    }
+
+    // Out of memory: the rest are NULL, and not counted.
+    if (ii < count)
+    {
+        long missing = count - ii;
+        stat_add(&hh->stats.allocs, -missing);
+        stat_add(&hh->stats.class_allocs[cls], -missing);
+        stat_add(&hh->stats.bytes_allocated, -missing * (long)bsize);
+        memset(out + ii, 0, missing * sizeof(void*));
+    }
+}
+
+// Our own small blocks go straight onto their free lists, looking the
+// span up only when the page changes, and again the stats are counted
+// once, as is the purge tick (by how many went on). Anything else
+// (medium, large, another thread's) goes via xfree.
+void
+xfree_batch(void** items, size_t count)
+{
+    heap* hh = xmallocHlp_get_heap();
+    long frees[NUM_CLASSES] = {0};
+    long total = 0;
+    long bytes = 0;
+
+    uintptr_t page = 0;
+    span* sp = NULL;
+    for (size_t ii = 0; ii < count; ++ii)
+    {
+        if (items[ii] == NULL)
+        {
+            continue;
+        }
+
+        if ((uintptr_t)items[ii] >> 12 != page)
+        {
+            page = (uintptr_t)items[ii] >> 12;
+            sp = pagemap_get(items[ii]);
+        }
+
+        if (sp == NULL || sp->cls < 0 || sp->owner != hh)
+        {
+            xfree(items[ii]);
+            continue;
+        }
+
+        int cls = sp->cls;
+        xmallocHlp_slab_push(hh, sp, (llist_node*)items[ii]);
+        frees[cls]++;
+        bytes += class_sizes[sp->cls];
+        total++;
+    }
+
+    for (int cls = 0; cls < NUM_CLASSES; ++cls)
+    {
+        if (frees[cls] != 0)
+        {
+            stat_add(&hh->stats.class_frees[cls], frees[cls]);
+        }
+    }
+    stat_add(&hh->stats.frees, total);
+    stat_add(&hh->stats.bytes_freed, bytes);
+
+    hh->purge_tick -= total;
+    if (hh->purge_tick <= 0)
+    {
+        xmallocHlp_maybe_purge(hh);
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+/////////////////////////////// regions /////////////////////////////
+
+// A region bumps through chunks of pages taken like large blocks (so
+// from the large span cache when it can), and gives them all back at
+// once. The region itself sits at the start of its first chunk.
+#define REGION_CHUNK_SIZE (64 * 1024)
+
+typedef struct region_chunk {
+    struct region_chunk* next;
+    size_t bytes;
+} region_chunk;
+
+struct xregion {
+    region_chunk* chunks; // the one being bumped through first
+    void* next;
+    void* end;
+};
+
+#define REGION_CHUNK_HEADER (div_up(sizeof(region_chunk), 16) * 16)
+
+static
+region_chunk*
+xmallocHlp_region_chunk(size_t bytes)
+{
+    int zeroed;
+    size_t num_pages = div_up(bytes, PAGE_SIZE);
+    region_chunk* chunk = xmallocHlp_large_alloc(num_pages, &zeroed);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->bytes = num_pages * PAGE_SIZE;
+    stat_add(&xmallocHlp_get_heap()->stats.bytes_allocated, chunk->bytes);
+    return chunk;
+}
+
+xregion*
+xregion_create()
+{
+    region_chunk* chunk = xmallocHlp_region_chunk(REGION_CHUNK_SIZE);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->next = NULL;
+
+    xregion* rr = (xregion*)((void*)chunk + REGION_CHUNK_HEADER);
+    rr->chunks = chunk;
+    rr->next = (void*)rr + div_up(sizeof(xregion), 16) * 16;
+    rr->end = (void*)chunk + chunk->bytes;
+    return rr;
+}
+
+// Anything over a quarter chunk gets a chunk of its own, kept behind the
+// current one, so what's left of that isn't thrown away.
+void*
+xregion_alloc(xregion* rr, size_t size)
+{
+    if (size > MAX_SIZE)
+    {
+        return NULL;
+    }
+
+    size = div_up(size, 16) * 16;
+    if (size <= (size_t)(rr->end - rr->next))
+    {
+        void* item = rr->next;
+        rr->next += size;
+        return item;
+    }
+
+    if (size > REGION_CHUNK_SIZE / 4)
+    {
+        region_chunk* chunk = xmallocHlp_region_chunk(REGION_CHUNK_HEADER + size);
+        if (chunk == NULL)
+        {
+            return NULL;
+        }
+        chunk->next = rr->chunks->next;
+        rr->chunks->next = chunk;
+        return (void*)chunk + REGION_CHUNK_HEADER;
+    }
+
+    region_chunk* chunk = xmallocHlp_region_chunk(REGION_CHUNK_SIZE);
+    if (chunk == NULL)
+    {
+        return NULL;
+    }
+    chunk->next = rr->chunks;
+    rr->chunks = chunk;
+    rr->next = (void*)chunk + REGION_CHUNK_HEADER + size;
+    rr->end = (void*)chunk + chunk->bytes;
+    return (void*)chunk + REGION_CHUNK_HEADER;
+}
+
+void
+xregion_destroy(xregion* rr)
+{
+    heap* hh = xmallocHlp_get_heap();
+    region_chunk* chunk = rr->chunks;
+    while (chunk != NULL)
+    {
+        region_chunk* next = chunk->next;
+        xmallocHlp_free_large(hh, chunk, chunk->bytes);
+        chunk = next;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+//////////////////////////////// pools //////////////////////////////
+
+// A pool packs objects of one size back to back in slabs of pages, with
+// no headers. Each thread keeps a magazine (a small stack) of free
+// objects per pool, so xpool_alloc and xpool_free are a pop and a push.
+// An empty magazine is refilled with half a magazine from the pool's own
+// free list (LIFO) or its slab, a full one gives its oldest half back,
+// both under the pool's lock. Pools live as long as the process.
+#define POOL_MAX 64
+#define POOL_MAG_SIZE 64
+#define POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct pool_magazine {
+    atomic_long count;
+    int owned;                  // by a running thread, or spare
+    struct pool_magazine* next; // all of the pool's magazines
+    void* items[POOL_MAG_SIZE];
+} pool_magazine;
+
+struct xpool {
+    int id;
+    size_t obj_size;
+    size_t stride;
+    size_t slab_size;
+    pthread_mutex_t lock;
+    llist_node* free_list; // only ->next is used
+    long free_length;
+    void* slab_next;
+    void* slab_end;
+    long slabs;
+    pool_magazine* magazines;
+};
+
+// pool_count only goes up once pools[] has the new pool in it, so it can
+// be read without pool_lock.
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static xpool* pools[POOL_MAX];
+static atomic_int pool_count = 0;
+static __thread pool_magazine* pool_mags[POOL_MAX];
+
+xpool*
+xpool_create(size_t obj_size, size_t align)
+{
+    assert(align != 0 && (align & (align - 1)) == 0 && align <= PAGE_SIZE);
+
+    pthread_mutex_lock(&pool_lock);
+    int id = atomic_load(&pool_count);
+    if (id == POOL_MAX)
+    {
+        pthread_mutex_unlock(&pool_lock);
+        return NULL;
+    }
+
+    xpool* pp = meta_alloc(sizeof(xpool));
+    pp->id = id;
+    pp->obj_size = obj_size;
+    size_t size = obj_size > sizeof(llist_node*) ? obj_size : sizeof(llist_node*);
+    pp->stride = div_up(size, align) * align;
+    pp->slab_size = pp->stride * 16 > POOL_SLAB_SIZE ? div_up(pp->stride * 16, PAGE_SIZE) * PAGE_SIZE
+                                                     : POOL_SLAB_SIZE;
+    pthread_mutex_init(&pp->lock, 0);
+    pools[id] = pp;
+    atomic_store(&pool_count, id + 1);
+    pthread_mutex_unlock(&pool_lock);
+    return pp;
+}
+
+// The calling thread's magazine for the pool: a spare one left by an
+// exited thread, or a new one. Making sure the thread has a heap means
+// it'll be handed back when the thread exits.
+static
+pool_magazine*
+xmallocHlp_pool_magazine(xpool* pp)
+{
+    xmallocHlp_get_heap();
+
+    pthread_mutex_lock(&pp->lock);
+    pool_magazine* mag = pp->magazines;
+    while (mag != NULL && mag->owned)
+    {
+        mag = mag->next;
+    }
+    if (mag == NULL)
+    {
+        mag = meta_alloc(sizeof(pool_magazine));
+        mag->next = pp->magazines;
+        pp->magazines = mag;
+    }
+    mag->owned = 1;
+    pthread_mutex_unlock(&pp->lock);
+
+    pool_mags[pp->id] = mag;
+    return mag;
+}
+
+static
+void
+xmallocHlp_pool_refill(xpool* pp, pool_magazine* mag)
+{
+    long count = stat_get(&mag->count);
+
+    pthread_mutex_lock(&pp->lock);
+    while (count < POOL_MAG_SIZE / 2 && pp->free_list != NULL)
+    {
+        mag->items[count++] = pp->free_list;
+        pp->free_list = pp->free_list->next;
+        pp->free_length--;
+    }
+    while (count < POOL_MAG_SIZE / 2)
+    {
+        if (pp->slab_next == pp->slab_end)
+        {
+            int zeroed;
+            void* slab = xmallocHlp_large_alloc(pp->slab_size / PAGE_SIZE, &zeroed);
+            if (slab == NULL)
+            {
+                break;
+            }
+            pp->slab_next = slab;
+            pp->slab_end = pp->slab_next + (pp->slab_size / pp->stride) * pp->stride;
+            pp->slabs++;
+            stat_add(&xmallocHlp_get_heap()->stats.bytes_allocated, pp->slab_size);
+        }
+        mag->items[count++] = pp->slab_next;
+        pp->slab_next += pp->stride;
+    }
+    pthread_mutex_unlock(&pp->lock);
+
+    stat_add(&mag->count, count - stat_get(&mag->count));
+}
+
+// Gives the oldest count objects of the magazine back to the pool.
+static
+void
+xmallocHlp_pool_drain(xpool* pp, pool_magazine* mag, long count)
+{
+    long left = stat_get(&mag->count) - count;
+
+    pthread_mutex_lock(&pp->lock);
+    for (long ii = count - 1; ii >= 0; --ii)
+    {
+        llist_node* node = (llist_node*)mag->items[ii];
+        node->next = pp->free_list;
+        pp->free_list = node;
+    }
+    pp->free_length += count;
+    pthread_mutex_unlock(&pp->lock);
+
+    memmove(mag->items, mag->items + count, left * sizeof(void*));
+    stat_add(&mag->count, -count);
+}
+
+// For fork(): pool_lock and then every pool's lock. A pool's lock is held
+// while it gets slabs and magazines, so these come before the large cache
+// and metadata locks.
+static
+void
+xmallocHlp_pool_lock_all()
+{
+    pthread_mutex_lock(&pool_lock);
+    int count = atomic_load(&pool_count);
+    for (int ii = 0; ii < count; ++ii)
+    {
+        pthread_mutex_lock(&pools[ii]->lock);
+    }
+}
+
+static
+void
+xmallocHlp_pool_unlock_all()
+{
+    int count = atomic_load(&pool_count);
+    for (int ii = count - 1; ii >= 0; --ii)
+    {
+        pthread_mutex_unlock(&pools[ii]->lock);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
+
+// Called as a thread exits: everything in its magazines goes back.
+static
+void
+xmallocHlp_pool_release()
+{
+    int count = atomic_load(&pool_count);
+    for (int ii = 0; ii < count; ++ii)
+    {
+        pool_magazine* mag = pool_mags[ii];
+        if (mag != NULL)
+        {
+            xmallocHlp_pool_drain(pools[ii], mag, stat_get(&mag->count));
+            pthread_mutex_lock(&pools[ii]->lock);
+            mag->owned = 0;
+            pthread_mutex_unlock(&pools[ii]->lock);
+            pool_mags[ii] = NULL;
+        }
+    }
+}
+
+void*
+xpool_alloc(xpool* pp)
+{
+    pool_magazine* mag = pool_mags[pp->id];
+    if (mag == NULL)
+    {
+        mag = xmallocHlp_pool_magazine(pp);
+    }
+
+    long count = stat_get(&mag->count);
+    if (count == 0)
+    {
+        xmallocHlp_pool_refill(pp, mag);
+        count = stat_get(&mag->count);
+        if (count == 0)
+        {
+            return NULL;
+        }
+    }
+    stat_add(&mag->count, -1);
+    return mag->items[count - 1];
+}
+
+void
+xpool_free(xpool* pp, void* item)
+{
+    pool_magazine* mag = pool_mags[pp->id];
+    if (mag == NULL)
+    {
+        mag = xmallocHlp_pool_magazine(pp);
+    }
+
+    long count = stat_get(&mag->count);
+    if (count == POOL_MAG_SIZE)
+    {
+        xmallocHlp_pool_drain(pp, mag, POOL_MAG_SIZE / 2);
+        count -= POOL_MAG_SIZE / 2;
+    }
+    mag->items[count] = item;
+    stat_add(&mag->count, 1);
+}
+
+// Magazine counts of other threads are read as they are, so the numbers
+// are a snapshot, not exact while the pool is in use.
+void
+xpool_get_stats(xpool* pp, xpool_stats* out)
+{
+    pthread_mutex_lock(&pp->lock);
+    out->obj_size = pp->obj_size;
+    out->stride = pp->stride;
+    out->slabs = pp->slabs;
+    out->capacity = pp->slabs * (long)(pp->slab_size / pp->stride);
+    out->free = pp->free_length + (pp->slab_end - pp->slab_next) / (long)pp->stride;
+    out->cached = 0;
+    for (pool_magazine* mag = pp->magazines; mag != NULL; mag = mag->next)
+    {
+        out->cached += stat_get(&mag->count);
+    }
+    pthread_mutex_unlock(&pp->lock);
+
+    out->in_use = out->capacity - out->free - out->cached;
+    out->occupancy = out->capacity > 0 ? (double)out->in_use / out->capacity : 0;
+}
+
+/////////////////////////////////////////////////////////////////////
+////////////////////////////// llist.c //////////////////////////////
+
+// based on generic linked list code and lecture code
+
+/*
+typedef struct llist_node {
+    size_t size;     // size of one node (which represents one free block)
+    struct free_list_node* next; // NULL if end of list
+} free_list_node;
+*/
+
+long
+llist_length(llist_node* list_head)
+{
+    long length = 0;
+    for (llist_node* node = list_head; node != NULL; node = node->next)
+    {
+        length++;
+    }
+    return length;
+}
@@ -0,0 +1,156 @@
+#ifndef OPT_MALLOC_H
+#define OPT_MALLOC_H
+
+// Extensions only the optimized allocator (opt_malloc.c) provides,
+// on top of the common interface in xmalloc.h.
+//
+// When out of memory, or asked for more than a quarter of the address
+// space, everything that allocates (xmalloc and friends included) returns
+// NULL: xrealloc leaves its block as it was, and xmalloc_batch sets the
+// rest of out to NULL.
+
+#include "xmalloc.h"
+
+// Caps the bytes of freed large (>= 1 page) blocks kept around for reuse
+// instead of being munmapped. Defaults to 4MB, or OPT_LARGE_CACHE_BYTES
+// from the environment. Lowering it unmaps whatever is over the new cap.
+void xmalloc_set_large_cache_limit(size_t bytes);
+
+// Bytes the block at item can hold, which can be more than were asked for.
+size_t xmalloc_usable_size(void* item);
+
+// A block of size bytes at a multiple of align, a power of two. Blocks
+// from xmalloc are already 16 byte aligned. Small requests come from the
+// first size class whose size is a multiple of align, bigger ones from a
+// medium block trimmed at both ends or from pages, so only a large block
+// aligned to a page or more pays for alignment (one extra page). Freed
+// with xfree as usual, or xfree_aligned_sized with the same align and
+// size: not xfree_sized, as the block can be in a bigger class than size
+// alone says.
+void* xmalloc_aligned(size_t align, size_t size);
+void xfree_aligned_sized(void* item, size_t align, size_t size);
+
+// count blocks of size bytes into out, and count blocks back. Cheaper
+// than as many xmalloc/xfree calls for small blocks; blocks from either
+// can also be freed (or come from) the usual way.
+void xmalloc_batch(size_t size, size_t count, void** out);
+void xfree_batch(void** items, size_t count);
+
+// Regions hand out 16 byte aligned memory that is only ever freed all at
+// once, by xregion_destroy: never pass it to xfree. A region can be used
+// by one thread at a time, and destroyed from any.
+typedef struct xregion xregion;
+
+xregion* xregion_create();
+void* xregion_alloc(xregion* rr, size_t size);
+void xregion_destroy(xregion* rr);
+
+// Pools of fixed size objects, packed without headers and aligned to
+// align (a power of two up to 4096). Only xpool_free frees them. Up to
+// 64 pools, which are never destroyed: past that xpool_create returns
+// NULL.
+typedef struct xpool xpool;
+
+typedef struct xpool_stats {
+    size_t obj_size;
+    size_t stride;    // bytes each object takes
+    long slabs;
+    long capacity;    // objects the slabs hold
+    long in_use;      // handed out and not freed
+    long cached;      // free, in threads' magazines
+    long free;        // free, in the pool itself (or never used)
+    double occupancy; // in_use / capacity
+} xpool_stats;
+
+xpool* xpool_create(size_t obj_size, size_t align);
+void* xpool_alloc(xpool* pp);
+void xpool_free(xpool* pp, void* item);
+void xpool_get_stats(xpool* pp, xpool_stats* out);
+
+// Gives back to the kernel what free memory it can: the calling thread's
+// magazines and the depot are emptied, and the heaps of the caller and of
+// exited threads swept for free slabs and pages (see purging), which are
+// dropped right away rather than lazily. Cached large spans are
+// unmapped. Returns how many bytes that was.
+size_t xmalloc_trim();
+
+// Starts a thread that gives back free slabs and cached large spans as
+// they age, instead of as soon as they're free: what became free stays
+// around for a while, all of it going over decay_ms milliseconds (along
+// a smoothstep curve). Also started by OPT_DECAY_MS in the environment.
+// Calling it again only changes the decay time. Returns 0, or the error
+// from pthread_create.
+int xmalloc_start_purger(long decay_ms);
+
+// Built with -DOPT_DEBUG, xfree_sized (xmalloc.h) and xfree_aligned_sized
+// assert that the size (and alignment) they're given agree with the
+// block's metadata.
+
+#define OPT_NUM_CLASSES 24
+
+// Process wide statistics, summed over the heaps of all threads (exited
+// ones included). Reading them costs O(threads) and never walks a list.
+typedef struct opt_stats {
+    long allocs;
+    long frees;
+    long bytes_in_use;       // block bytes handed out and not yet freed
+    long bytes_mapped;       // bytes currently mmapped, bookkeeping included
+    long peak_bytes_mapped;  // high water mark of bytes_mapped
+    long peak_rss;           // peak resident set size (getrusage), in bytes
+    long pages_mapped;
+    long pages_unmapped;
+    long free_blocks;        // blocks sitting on free lists, magazines included
+    long magazine_blocks;    // free size class blocks in threads' magazines
+    long depot_blocks;       // and in the magazines in the depot
+    long chunks_reserved;
+    long pages_carved;
+    long bytes_flushed;      // free bytes exited threads handed over to others
+    long pages_purged;       // pages given back with madvise, still mapped
+    long purges;             // heap sweeps for pages to give back
+    long empty_slabs;        // slabs given back whole, waiting for reuse
+    long dirty_slabs;        // of which the purger hasn't given back the pages yet
+    long purger_passes;      // times the purger thread woke up
+    long purger_pages;       // pages it gave back (in pages_purged too)
+    long purger_bytes_unmapped; // bytes of cached large spans it unmapped
+    size_t class_sizes[OPT_NUM_CLASSES];
+    long class_allocs[OPT_NUM_CLASSES];
+    long class_frees[OPT_NUM_CLASSES];
+} opt_stats;
+
+void xmalloc_get_stats(opt_stats* out);
+
+// Latency of xmalloc and xfree, in cycles (rdtsc), split by block size and
+// by the path the call took. Only recorded when opt_malloc.c is built with
+// -DOPT_LATENCY (the *-lat targets), otherwise every count reads 0. If
+// OPT_LATENCY_DUMP is set in the environment, the table is printed to
+// stderr at exit.
+enum {
+    OPT_LAT_SMALL,  // size class blocks (<= 2048)
+    OPT_LAT_MEDIUM,
+    OPT_LAT_LARGE,
+    OPT_LAT_SIZES,
+};
+
+enum {
+    OPT_LAT_ALLOC_FREELIST, // reused a free block (or cached large span)
+    OPT_LAT_ALLOC_CARVE,    // carved a new block out of reserved space
+    OPT_LAT_ALLOC_MMAP,     // had to mmap (a chunk, or a large block)
+    OPT_LAT_FREE_LOCAL,     // back on one of our own lists (or the large cache)
+    OPT_LAT_FREE_REMOTE,    // pushed back to the heap of another thread
+    OPT_LAT_FREE_UNMAP,     // munmapped
+    OPT_LAT_PATHS,
+};
+
+typedef struct opt_latency {
+    long count;
+    long p50;  // percentiles are the upper edge of their histogram bucket,
+    long p99;  // which is at most 25% above the true value
+    long p999;
+    long max;
+} opt_latency;
+
+// Merged over the histograms of all threads.
+void xmalloc_get_latency(opt_latency out[OPT_LAT_SIZES][OPT_LAT_PATHS]);
+void xmalloc_print_latency();
+
+#endif
@@ -0,0 +1,146 @@
+// The standard allocation functions on top of opt_malloc.c, built into
+// libopt_malloc.so so unmodified programs can run on it:
+//
+//   LD_PRELOAD=./libopt_malloc.so ls -l
+//
+// The library is built with the initial-exec TLS model, so reaching a
+// thread's heap never goes through __tls_get_addr (which can allocate),
+// and with hidden visibility, so only what's marked PUBLIC is exported.
+// Programs often have an xmalloc of their own (bash, readline), and ours
+// must neither be overridden by it nor override it.
+
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "opt_malloc.h"
+
+#define ALIGN_MIN 16
+#define PUBLIC __attribute__((visibility("default")))
+
+static inline
+int
+is_pow2(size_t nn)
+{
+    return nn != 0 && (nn & (nn - 1)) == 0;
+}
+
+// A NULL from opt means it's out of memory.
+static inline
+void*
+nomem(void* ptr)
+{
+    if (ptr == NULL)
+    {
+        errno = ENOMEM;
+    }
+    return ptr;
+}
+
+PUBLIC
+void*
+malloc(size_t size)
+{
+    return nomem(xmalloc(size));
+}
+
+PUBLIC
+void
+free(void* ptr)
+{
+    xfree(ptr);
+}
+
+PUBLIC
+void*
+calloc(size_t nmemb, size_t size)
+{
+    return nomem(xcalloc(nmemb, size));
+}
+
+// Like glibc, realloc(ptr, 0) frees ptr.
+PUBLIC
+void*
+realloc(void* ptr, size_t size)
+{
+    if (ptr != NULL && size == 0)
+    {
+        xfree(ptr);
+        return NULL;
+    }
+    return nomem(xrealloc(ptr, size));
+}
+
+PUBLIC
+int
+posix_memalign(void** out, size_t align, size_t size)
+{
+    if (!is_pow2(align) || align % sizeof(void*) != 0)
+    {
+        return EINVAL;
+    }
+
+    void* ptr = xmalloc_aligned(align, size);
+    if (ptr == NULL)
+    {
+        return ENOMEM;
+    }
+    *out = ptr;
+    return 0;
+}
+
+PUBLIC
+void*
+aligned_alloc(size_t align, size_t size)
+{
+    if (!is_pow2(align))
+    {
+        errno = EINVAL;
+        return NULL;
+    }
+    return nomem(xmalloc_aligned(align, size));
+}
+
+PUBLIC
+void*
+memalign(size_t align, size_t size)
+{
+    return aligned_alloc(align < ALIGN_MIN ? ALIGN_MIN : align, size);
+}
+
+PUBLIC
+void*
+valloc(size_t size)
+{
+    return nomem(xmalloc_aligned(sysconf(_SC_PAGESIZE), size));
+}
+
+PUBLIC
+void*
+pvalloc(size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    if (size > SIZE_MAX - page)
+    {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return nomem(xmalloc_aligned(page, (size + page - 1) / page * page));
+}
+
+PUBLIC
+size_t
+malloc_usable_size(void* ptr)
+{
+    return xmalloc_usable_size(ptr);
+}
+
+// Like glibc's, returns 1 if any memory went back to the kernel. There's
+// no top of heap to leave pad bytes at, so pad is ignored.
+PUBLIC
+int
+malloc_trim(size_t pad)
+{
+    return xmalloc_trim() > 0;
+}
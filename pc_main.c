@@ -0,0 +1,280 @@
+// Producer/consumer benchmark.
+//
+// Producer threads allocate messages of varied sizes and pass them
+// through bounded queues to consumer threads, which free them. So every
+// block is freed by a different thread than the one that allocated it,
+// which is what remote frees cost.
+//
+//   pc-opt [PRODUCERS CONSUMERS MESSAGES]
+//
+// MESSAGES is per producer. Reports throughput, xmalloc and xfree
+// latency percentiles, and RSS once everything has been freed.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "xmalloc.h"
+
+#define QUEUE_CAP 256
+
+// A bounded queue of messages, one per consumer.
+typedef struct queue {
+    void* items[QUEUE_CAP];
+    long head;
+    long count;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+} queue;
+
+// Every message starts with this, the rest is filler.
+typedef struct message {
+    long size;
+    long seq;
+} message;
+
+typedef struct worker_args {
+    long id;
+    long* lat;    // latency of every call, in ns
+    long lat_len;
+} worker_args;
+
+int producers = 2;
+int consumers = 2;
+long messages = 200000;
+queue* queues;
+
+static
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+void
+queue_push(queue* qq, void* item)
+{
+    pthread_mutex_lock(&qq->lock);
+    while (qq->count == QUEUE_CAP) {
+        pthread_cond_wait(&qq->not_full, &qq->lock);
+    }
+    qq->items[(qq->head + qq->count) % QUEUE_CAP] = item;
+    qq->count += 1;
+    pthread_cond_signal(&qq->not_empty);
+    pthread_mutex_unlock(&qq->lock);
+}
+
+void*
+queue_pop(queue* qq)
+{
+    pthread_mutex_lock(&qq->lock);
+    while (qq->count == 0) {
+        pthread_cond_wait(&qq->not_empty, &qq->lock);
+    }
+    void* item = qq->items[qq->head];
+    qq->head = (qq->head + 1) % QUEUE_CAP;
+    qq->count -= 1;
+    pthread_cond_signal(&qq->not_full);
+    pthread_mutex_unlock(&qq->lock);
+    return item;
+}
+
+// Mostly small messages, some medium, a few large.
+long
+next_size(uint64_t* state)
+{
+    uint64_t xx = *state;
+    xx ^= xx << 13;
+    xx ^= xx >> 7;
+    xx ^= xx << 17;
+    *state = xx;
+
+    long pick = xx % 100;
+    long rr = (xx >> 8) & 0xffff;
+    if (pick < 70) {
+        return sizeof(message) + rr % 240;
+    }
+    else if (pick < 95) {
+        return 256 + rr % 3840;
+    }
+    else {
+        return 4096 + rr % 61440;
+    }
+}
+
+void*
+producer(void* arg)
+{
+    worker_args* wa = (worker_args*)arg;
+    uint64_t state = 0x9e3779b97f4a7c15 ^ (wa->id + 1);
+
+    for (long ii = 0; ii < messages; ++ii) {
+        long size = next_size(&state);
+
+        long t0 = now_ns();
+        message* mm = xmalloc(size);
+        wa->lat[wa->lat_len++] = now_ns() - t0;
+
+        mm->size = size;
+        mm->seq = ii;
+        memset(mm + 1, 0x5a, size - sizeof(message));
+
+        queue_push(&queues[(wa->id + ii) % consumers], mm);
+    }
+    return 0;
+}
+
+void*
+consumer(void* arg)
+{
+    worker_args* wa = (worker_args*)arg;
+    queue* qq = &queues[wa->id];
+
+    for (;;) {
+        message* mm = queue_pop(qq);
+        if (mm == NULL) {
+            break;
+        }
+        assert(mm->size >= sizeof(message) && mm->seq >= 0);
+
+        long t0 = now_ns();
+        xfree(mm);
+        wa->lat[wa->lat_len++] = now_ns() - t0;
+    }
+    return 0;
+}
+
+int
+cmp_long(const void* aa, const void* bb)
+{
+    long xx = *(const long*)aa;
+    long yy = *(const long*)bb;
+    return (xx > yy) - (xx < yy);
+}
+
+// Merges the latencies of a group of threads, sorts and prints them.
+void
+print_latency(const char* name, worker_args* was, int count)
+{
+    long total = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        total += was[ii].lat_len;
+    }
+
+    long* all = malloc(total * sizeof(long));
+    long nn = 0;
+    for (int ii = 0; ii < count; ++ii) {
+        memcpy(all + nn, was[ii].lat, was[ii].lat_len * sizeof(long));
+        nn += was[ii].lat_len;
+    }
+    qsort(all, total, sizeof(long), cmp_long);
+
+    printf("%s latency ns: p50 %ld, p90 %ld, p99 %ld, p99.9 %ld, max %ld\n", name,
+           all[total * 50 / 100], all[total * 90 / 100], all[total * 99 / 100],
+           all[total * 999 / 1000], all[total - 1]);
+    free(all);
+}
+
+// Reads a "Name:   1234 kB" line from /proc/self/status.
+long
+status_kb(const char* name)
+{
+    FILE* ff = fopen("/proc/self/status", "r");
+    if (ff == NULL) {
+        return -1;
+    }
+
+    char line[256];
+    long kb = -1;
+    size_t len = strlen(name);
+    while (fgets(line, sizeof(line), ff)) {
+        if (strncmp(line, name, len) == 0 && line[len] == ':') {
+            kb = atol(line + len + 1);
+        }
+    }
+    fclose(ff);
+    return kb;
+}
+
+int
+main(int argc, char* argv[])
+{
+    if (argc != 1 && argc != 4) {
+        printf("Usage:\n");
+        printf("\t%s [PRODUCERS CONSUMERS MESSAGES]\n", argv[0]);
+        return 1;
+    }
+    if (argc == 4) {
+        producers = atoi(argv[1]);
+        consumers = atoi(argv[2]);
+        messages  = atol(argv[3]);
+    }
+    assert(producers > 0 && consumers > 0 && messages > 0);
+
+    // Bookkeeping uses the system allocator, so only messages go through xmalloc.
+    queues = calloc(consumers, sizeof(queue));
+    for (int ii = 0; ii < consumers; ++ii) {
+        pthread_mutex_init(&queues[ii].lock, 0);
+        pthread_cond_init(&queues[ii].not_empty, 0);
+        pthread_cond_init(&queues[ii].not_full, 0);
+    }
+
+    long total = producers * messages;
+    worker_args* pargs = calloc(producers, sizeof(worker_args));
+    worker_args* cargs = calloc(consumers, sizeof(worker_args));
+    pthread_t* pthreads = calloc(producers, sizeof(pthread_t));
+    pthread_t* cthreads = calloc(consumers, sizeof(pthread_t));
+
+    long t0 = now_ns();
+    for (int ii = 0; ii < consumers; ++ii) {
+        cargs[ii].id = ii;
+        cargs[ii].lat = malloc((total / consumers + producers) * sizeof(long));
+        int rv = pthread_create(&cthreads[ii], 0, consumer, &cargs[ii]);
+        assert(rv == 0);
+    }
+    for (int ii = 0; ii < producers; ++ii) {
+        pargs[ii].id = ii;
+        pargs[ii].lat = malloc(messages * sizeof(long));
+        int rv = pthread_create(&pthreads[ii], 0, producer, &pargs[ii]);
+        assert(rv == 0);
+    }
+
+    for (int ii = 0; ii < producers; ++ii) {
+        int rv = pthread_join(pthreads[ii], 0);
+        assert(rv == 0);
+    }
+    for (int ii = 0; ii < consumers; ++ii) {
+        queue_push(&queues[ii], NULL);
+    }
+    for (int ii = 0; ii < consumers; ++ii) {
+        int rv = pthread_join(cthreads[ii], 0);
+        assert(rv == 0);
+    }
+    double seconds = (now_ns() - t0) / 1e9;
+
+    printf("pc: %d producers, %d consumers, %ld messages\n", producers, consumers, total);
+    printf("throughput: %.0f msgs/sec (%.3fs)\n", total / seconds, seconds);
+    print_latency("xmalloc", pargs, producers);
+    print_latency("xfree", cargs, consumers);
+    printf("rss: final %ld kB, peak %ld kB\n", status_kb("VmRSS"), status_kb("VmHWM"));
+
+    for (int ii = 0; ii < producers; ++ii) {
+        free(pargs[ii].lat);
+    }
+    for (int ii = 0; ii < consumers; ++ii) {
+        free(cargs[ii].lat);
+    }
+    free(pargs);
+    free(cargs);
+    free(pthreads);
+    free(cthreads);
+    free(queues);
+    return 0;
+}
@@ -0,0 +1,164 @@
+// Checks libopt_malloc.so as the C library's allocator: the standard
+// functions, and how they fail.
+//
+//   LD_PRELOAD=./libopt_malloc.so ./preload-test
+//
+// Prints "preload test ok", or what failed and exits 1.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <malloc.h>
+
+#define check(cond, ...) do { \
+    if (!(cond)) { \
+        printf("preload test failed: " __VA_ARGS__); \
+        printf("\n"); \
+        exit(1); \
+    } \
+} while (0)
+
+// Sizes no allocator can give; 1 << 50 at least passes every size check.
+// Volatile, so the compiler doesn't reject the calls outright.
+static volatile size_t huge[] = { SIZE_MAX, SIZE_MAX - 8, SIZE_MAX / 2, (size_t)1 << 50 };
+#define NUM_HUGE (sizeof(huge) / sizeof(huge[0]))
+
+// opt rounds 129 bytes up to its 160 byte class, glibc to 136.
+static
+void
+test_preloaded()
+{
+    void* ptr = malloc(129);
+    check(ptr != NULL, "malloc(129)");
+    check(malloc_usable_size(ptr) == 160, "not running on opt (usable size %zu)",
+          malloc_usable_size(ptr));
+    free(ptr);
+}
+
+static
+void
+test_basics()
+{
+    free(NULL);
+
+    char* ptr = calloc(1000, 10);
+    check(ptr != NULL, "calloc");
+    for (int ii = 0; ii < 10000; ++ii) {
+        check(ptr[ii] == 0, "calloc: byte %d isn't zero", ii);
+    }
+    memset(ptr, 7, 10000);
+
+    // realloc keeps what fits, and with 0 frees.
+    ptr = realloc(ptr, 200000);
+    check(ptr != NULL && ptr[9999] == 7, "realloc: grow lost the contents");
+    ptr = realloc(ptr, 10);
+    check(ptr != NULL && ptr[9] == 7, "realloc: shrink lost the contents");
+    check(realloc(ptr, 0) == NULL, "realloc(ptr, 0) didn't free");
+
+    ptr = realloc(NULL, 50);
+    check(ptr != NULL, "realloc(NULL, 50)");
+    free(ptr);
+}
+
+static
+void
+test_aligned()
+{
+    static const size_t aligns[] = { 8, 16, 32, 64, 256, 4096, 65536 };
+    static const size_t sizes[] = { 1, 100, 3000, 20000, 300000 };
+
+    for (int aa = 0; aa < sizeof(aligns) / sizeof(aligns[0]); ++aa) {
+        for (int ss = 0; ss < sizeof(sizes) / sizeof(sizes[0]); ++ss) {
+            size_t align = aligns[aa];
+            size_t size = sizes[ss];
+            void* ptr = NULL;
+            check(posix_memalign(&ptr, align, size) == 0 && (uintptr_t)ptr % align == 0,
+                  "posix_memalign(%zu, %zu)", align, size);
+            memset(ptr, 1, size);
+            free(ptr);
+
+            ptr = aligned_alloc(align, size);
+            check(ptr != NULL && (uintptr_t)ptr % align == 0, "aligned_alloc(%zu, %zu)", align, size);
+            free(ptr);
+
+            ptr = memalign(align, size);
+            check(ptr != NULL && (uintptr_t)ptr % align == 0, "memalign(%zu, %zu)", align, size);
+            free(ptr);
+        }
+    }
+
+    void* ptr = NULL;
+    check(posix_memalign(&ptr, 24, 10) == EINVAL, "posix_memalign: bad align");
+    errno = 0;
+    check(aligned_alloc(24, 10) == NULL && errno == EINVAL, "aligned_alloc: bad align");
+
+    ptr = valloc(10);
+    check(ptr != NULL && (uintptr_t)ptr % 4096 == 0, "valloc");
+    free(ptr);
+    ptr = pvalloc(10);
+    check(ptr != NULL && (uintptr_t)ptr % 4096 == 0 && malloc_usable_size(ptr) >= 4096, "pvalloc");
+    free(ptr);
+}
+
+// Every way of asking for too much gives NULL (or ENOMEM) with errno set,
+// and leaves realloc's block alone.
+static
+void
+test_nomem()
+{
+    for (int ii = 0; ii < NUM_HUGE; ++ii) {
+        size_t size = huge[ii];
+
+        errno = 0;
+        check(malloc(size) == NULL && errno == ENOMEM, "malloc(%zx)", size);
+        errno = 0;
+        check(calloc(1, size) == NULL && errno == ENOMEM, "calloc(1, %zx)", size);
+        errno = 0;
+        check(memalign(64, size) == NULL && errno == ENOMEM, "memalign(64, %zx)", size);
+        errno = 0;
+        check(aligned_alloc(4096, size) == NULL && errno == ENOMEM, "aligned_alloc(4096, %zx)", size);
+        errno = 0;
+        check(valloc(size) == NULL && errno == ENOMEM, "valloc(%zx)", size);
+        errno = 0;
+        check(pvalloc(size) == NULL && errno == ENOMEM, "pvalloc(%zx)", size);
+
+        void* ptr = (void*)1;
+        check(posix_memalign(&ptr, 64, size) == ENOMEM && ptr == (void*)1, "posix_memalign(64, %zx)", size);
+
+        char* small = malloc(100);
+        memset(small, 5, 100);
+        errno = 0;
+        check(realloc(small, size) == NULL && errno == ENOMEM, "realloc(small, %zx)", size);
+        check(small[99] == 5, "realloc(small, %zx) changed the block", size);
+        free(small);
+
+        char* large = malloc(100000);
+        memset(large, 6, 100000);
+        errno = 0;
+        check(realloc(large, size) == NULL && errno == ENOMEM, "realloc(large, %zx)", size);
+        check(large[99999] == 6, "realloc(large, %zx) changed the block", size);
+        free(large);
+    }
+
+    errno = 0;
+    check(calloc(huge[2], 4) == NULL && errno == ENOMEM, "calloc overflow");
+
+    // Still fine afterwards.
+    void* ptr = malloc(1000);
+    check(ptr != NULL, "malloc after running out");
+    free(ptr);
+}
+
+int
+main(int argc, char* argv[])
+{
+    test_preloaded();
+    test_basics();
+    test_aligned();
+    test_nomem();
+
+    printf("preload test ok\n");
+    return 0;
+}
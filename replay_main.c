@@ -0,0 +1,269 @@
+// Allocation trace replayer.
+//
+// Re-runs a trace recorded by xtrace.c against whichever allocator this
+// is linked with, so allocators can be compared on identical input:
+//
+//   replay-opt [-s] TRACE
+//
+// Every recorded thread is replayed by a thread of its own, making the
+// same calls in the same order. A call on a block another thread made
+// waits for it, so blocks still change hands as they did. With -s the
+// whole trace is replayed in time order on one thread instead.
+//
+// Reports the time taken, the peak of live bytes asked for (a property
+// of the trace) and the peak RSS (a property of the allocator). The RSS
+// is counted from just before the replay, so the replayer's own copy of
+// the trace isn't in it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <assert.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+typedef struct replay_thread {
+    xtrace_rec** recs; // this thread's records, in order
+    long count;
+} replay_thread;
+
+xtrace_rec* recs;
+long num_recs;
+long* seqs;        // for each record, how many earlier ones there are for its block
+void** blocks;     // block id -> current pointer
+atomic_long* done; // block id -> how many of its records have been replayed
+
+static
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+// A "Vm...:" line of /proc/self/status, in kB. -1 if it isn't there.
+static
+long
+status_kb(const char* field)
+{
+    char line[256];
+    long kb = -1;
+    FILE* fh = fopen("/proc/self/status", "r");
+    if (fh == NULL) {
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fh) != NULL) {
+        if (strncmp(line, field, strlen(field)) == 0) {
+            kb = atol(line + strlen(field));
+            break;
+        }
+    }
+    fclose(fh);
+    return kb;
+}
+
+// Starts the peak RSS (VmHWM) over from the current RSS (Linux 4.0+).
+static
+int
+reset_peak_rss()
+{
+    FILE* fh = fopen("/proc/self/clear_refs", "w");
+    if (fh == NULL) {
+        return 0;
+    }
+    int ok = fputs("5", fh) >= 0;
+    return fclose(fh) == 0 && ok;
+}
+
+int
+cmp_time(const void* aa, const void* bb)
+{
+    const xtrace_rec* xx = *(xtrace_rec* const*)aa;
+    const xtrace_rec* yy = *(xtrace_rec* const*)bb;
+    if (xx->time != yy->time) {
+        return (xx->time > yy->time) - (xx->time < yy->time);
+    }
+    return (xx > yy) - (xx < yy);
+}
+
+void
+replay_one(xtrace_rec* rec)
+{
+    switch (rec->op) {
+        case XTRACE_MALLOC:
+            blocks[rec->id] = xmalloc(rec->size);
+            // touch it, as the program would have
+            *((char*)blocks[rec->id]) = 1;
+            break;
+        case XTRACE_REALLOC:
+            blocks[rec->id] = xrealloc(blocks[rec->id], rec->size);
+            break;
+        case XTRACE_FREE:
+            xfree(blocks[rec->id]);
+            blocks[rec->id] = 0;
+            break;
+        default:
+            assert(0);
+    }
+}
+
+void*
+replay_worker(void* arg)
+{
+    replay_thread* rt = (replay_thread*)arg;
+    for (long ii = 0; ii < rt->count; ++ii) {
+        xtrace_rec* rec = rt->recs[ii];
+        long seq = seqs[rec - recs];
+
+        // wait for whoever is before us on this block
+        while (atomic_load_explicit(&done[rec->id], memory_order_acquire) != seq) {
+            sched_yield();
+        }
+        replay_one(rec);
+        atomic_store_explicit(&done[rec->id], seq + 1, memory_order_release);
+    }
+    return 0;
+}
+
+int
+main(int argc, char* argv[])
+{
+    int serial = 0;
+    const char* path = NULL;
+    if (argc == 3 && strcmp(argv[1], "-s") == 0) {
+        serial = 1;
+        path = argv[2];
+    }
+    else if (argc == 2) {
+        path = argv[1];
+    }
+    else {
+        printf("Usage:\n");
+        printf("\t%s [-s] TRACE\n", argv[0]);
+        return 1;
+    }
+
+    // The replayer's own memory comes from the system allocator.
+    FILE* ff = fopen(path, "rb");
+    if (ff == NULL) {
+        perror(path);
+        return 1;
+    }
+    uint64_t magic = 0;
+    if (fread(&magic, sizeof(magic), 1, ff) != 1 || magic != XTRACE_MAGIC) {
+        fprintf(stderr, "%s: not a trace\n", path);
+        return 1;
+    }
+    fseek(ff, 0, SEEK_END);
+    num_recs = (ftell(ff) - sizeof(magic)) / sizeof(xtrace_rec);
+    fseek(ff, sizeof(magic), SEEK_SET);
+    recs = malloc(num_recs * sizeof(xtrace_rec) + 1);
+    long got = fread(recs, sizeof(xtrace_rec), num_recs, ff);
+    assert(got == num_recs);
+    fclose(ff);
+
+    // Put the records in time order, numbering each block's records and
+    // working out the peak of live bytes as we go.
+    xtrace_rec** order = malloc(num_recs * sizeof(xtrace_rec*) + 1);
+    uint32_t max_id = 0;
+    int num_threads = 0;
+    for (long ii = 0; ii < num_recs; ++ii) {
+        order[ii] = &recs[ii];
+        max_id = recs[ii].id > max_id ? recs[ii].id : max_id;
+        num_threads = recs[ii].thread >= num_threads ? recs[ii].thread + 1 : num_threads;
+    }
+    qsort(order, num_recs, sizeof(xtrace_rec*), cmp_time);
+
+    seqs = malloc(num_recs * sizeof(long) + 1);
+    long* counts = calloc(max_id + 1, sizeof(long));
+    size_t* sizes = calloc(max_id + 1, sizeof(size_t));
+    long live = 0;
+    long peak_live = 0;
+    for (long ii = 0; ii < num_recs; ++ii) {
+        xtrace_rec* rec = order[ii];
+        seqs[rec - recs] = counts[rec->id]++;
+        live += rec->size - sizes[rec->id];
+        sizes[rec->id] = rec->size;
+        peak_live = live > peak_live ? live : peak_live;
+    }
+    free(counts);
+    free(sizes);
+
+    blocks = calloc(max_id + 1, sizeof(void*));
+    done = calloc(max_id + 1, sizeof(atomic_long));
+
+    // What the replayer holds by now (the trace and its tables) is taken
+    // off the peak. Where the peak can't be started over, ru_maxrss is
+    // the best there is, though a peak from before this would hide
+    // the replay's.
+    int peak_reset = reset_peak_rss();
+    long base_kb = status_kb("VmRSS:");
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    long base_max_kb = usage.ru_maxrss;
+
+    long t0 = now_ns();
+    if (serial) {
+        for (long ii = 0; ii < num_recs; ++ii) {
+            replay_one(order[ii]);
+        }
+    }
+    else {
+        // Each thread's records, in the order the file has them in (which
+        // is the order that thread made them).
+        replay_thread* rts = calloc(num_threads, sizeof(replay_thread));
+        for (long ii = 0; ii < num_recs; ++ii) {
+            rts[recs[ii].thread].count++;
+        }
+        for (int tt = 0; tt < num_threads; ++tt) {
+            rts[tt].recs = malloc(rts[tt].count * sizeof(xtrace_rec*) + 1);
+            rts[tt].count = 0;
+        }
+        for (long ii = 0; ii < num_recs; ++ii) {
+            replay_thread* rt = &rts[recs[ii].thread];
+            rt->recs[rt->count++] = &recs[ii];
+        }
+
+        pthread_t* threads = malloc(num_threads * sizeof(pthread_t) + 1);
+        for (int tt = 0; tt < num_threads; ++tt) {
+            int rv = pthread_create(&threads[tt], 0, replay_worker, &rts[tt]);
+            assert(rv == 0);
+        }
+        for (int tt = 0; tt < num_threads; ++tt) {
+            int rv = pthread_join(threads[tt], 0);
+            assert(rv == 0);
+            free(rts[tt].recs);
+        }
+        free(threads);
+        free(rts);
+    }
+    double seconds = (now_ns() - t0) / 1e9;
+
+    long peak_kb;
+    if (peak_reset && base_kb >= 0 && (peak_kb = status_kb("VmHWM:")) >= 0) {
+        peak_kb -= base_kb;
+    }
+    else {
+        getrusage(RUSAGE_SELF, &usage);
+        peak_kb = usage.ru_maxrss - base_max_kb;
+    }
+
+    printf("replay: %ld calls on %d threads%s\n", num_recs, num_threads, serial ? " (serial)" : "");
+    printf("time: %.3fs\n", seconds);
+    printf("peak live bytes: %ld\n", peak_live);
+    printf("peak rss: %ld kB\n", peak_kb > 0 ? peak_kb : 0);
+
+    free(order);
+    free(seqs);
+    free(blocks);
+    free((void*)done);
+    free(recs);
+    return 0;
+}
@@ -15,8 +15,20 @@ xfree(void* ptr)
     free(ptr);
 }
 
+void
+xfree_sized(void* ptr, size_t bytes)
+{
+    free(ptr);
+}
+
 void*
 xrealloc(void* prev, size_t bytes)
 {
     return realloc(prev, bytes);
 }
+
+void*
+xcalloc(size_t nmemb, size_t size)
+{
+    return calloc(nmemb, size);
+}
@@ -4,7 +4,8 @@ use warnings FATAL => 'all';
 use POSIX ":sys_wait_h";
 
 use Time::HiRes qw(time);
-use Test::Simple tests => 14;
+use Cwd;
+use Test::Simple tests => 19;
 
 sub crc_check {
     my ($file, $expect) = @_;
@@ -75,6 +76,23 @@ my $fragt = run_prog("frag-opt", 1);
 my $ft_ok = $fragt =~ /frag test ok/;
 ok($ft_ok, "fragmentation test");
 
+my $api_o = run_prog("api-opt", "");
+ok($api_o =~ /api test ok/, "api test opt");
+
+my $api_t = run_prog("api-tlsf", "");
+ok($api_t =~ /api test ok/, "api test tlsf");
+
+my $api_d = run_prog("api-debug", "");
+ok($api_d =~ /api test ok/, "api test debug");
+
+my $api_p = run_prog("api-opt", "percpu");
+ok($api_p =~ /api test ok/, "api test percpu");
+
+$ENV{LD_PRELOAD} = getcwd() . "/libopt_malloc.so";
+my $pre = run_prog("preload-test", "");
+delete $ENV{LD_PRELOAD};
+ok($pre =~ /preload test ok/, "preload test");
+
 sub clang_check {
     my $errs = `clang-check *.c -- 2>&1`;
     chomp $errs;
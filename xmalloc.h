@@ -5,6 +5,10 @@
 
 void* xmalloc(size_t bytes);
 void  xfree(void* ptr);
+// ptr must come from xmalloc/xrealloc/xcalloc, and size be the size last
+// asked for (nmemb * size for xcalloc).
+void  xfree_sized(void* ptr, size_t size);
 void* xrealloc(void* item, size_t size);
+void* xcalloc(size_t nmemb, size_t size);
 
 #endif
@@ -0,0 +1,250 @@
+// Allocation trace recorder.
+//
+// Linked in front of an allocator with --wrap for each of its calls (see
+// WRAP and the *-trace targets in the Makefile). If XMALLOC_TRACE names a
+// file, every call is recorded into it (see xtrace.h), otherwise calls go
+// straight through.
+//
+// Traced blocks carry a 16 byte prefix holding their id, so frees and
+// reallocs from any thread find it without a shared pointer map, and
+// ids are never reused. Records go into a per-thread buffer, appended
+// to the file under a lock when it fills up and when the thread exits.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "xmalloc.h"
+#include "xtrace.h"
+
+#define XTRACE_PREFIX 16
+#define XTRACE_BUF 4096
+
+void* __real_xmalloc(size_t bytes);
+void  __real_xfree(void* ptr);
+void* __real_xrealloc(void* item, size_t size);
+void  __real_xfree_sized(void* ptr, size_t size);
+void* __real_xcalloc(size_t nmemb, size_t size);
+
+typedef struct xtrace_buf {
+    long count;
+    xtrace_rec recs[XTRACE_BUF];
+} xtrace_buf;
+
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static int trace_fd = -1;
+static long trace_start;
+static atomic_uint next_id = 1;
+static atomic_int next_thread = 0;
+
+static __thread xtrace_buf* local_buf = NULL;
+static __thread int local_thread = -1;
+
+static
+long
+now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static
+void
+xtrace_flush(xtrace_buf* buf)
+{
+    pthread_mutex_lock(&trace_lock);
+    size_t bytes = buf->count * sizeof(xtrace_rec);
+    ssize_t rv = write(trace_fd, buf->recs, bytes);
+    assert(rv == (ssize_t)bytes);
+    pthread_mutex_unlock(&trace_lock);
+    buf->count = 0;
+}
+
+// pthread key destructor, flushes what an exiting thread has left.
+static
+void
+xtrace_release(void* arg)
+{
+    xtrace_buf* buf = (xtrace_buf*)arg;
+    xtrace_flush(buf);
+    free(buf);
+    local_buf = NULL;
+}
+
+// The main thread doesn't run key destructors, so it's flushed at exit.
+static
+void
+xtrace_atexit()
+{
+    if (local_buf != NULL)
+    {
+        xtrace_flush(local_buf);
+    }
+}
+
+static
+void
+xtrace_init()
+{
+    const char* path = getenv("XMALLOC_TRACE");
+    if (path == NULL || path[0] == 0)
+    {
+        return;
+    }
+
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (trace_fd < 0)
+    {
+        perror(path);
+        exit(1);
+    }
+
+    uint64_t magic = XTRACE_MAGIC;
+    ssize_t rv = write(trace_fd, &magic, sizeof(magic));
+    assert(rv == sizeof(magic));
+
+    trace_start = now_ns();
+    pthread_key_create(&trace_key, xtrace_release);
+    atexit(xtrace_atexit);
+}
+
+static inline
+int
+xtrace_enabled()
+{
+    pthread_once(&trace_once, xtrace_init);
+    return trace_fd >= 0;
+}
+
+static
+void
+xtrace_record(int op, uint32_t id, size_t size, long time)
+{
+    if (local_buf == NULL)
+    {
+        local_buf = malloc(sizeof(xtrace_buf));
+        local_buf->count = 0;
+        local_thread = atomic_fetch_add(&next_thread, 1);
+        pthread_setspecific(trace_key, local_buf);
+    }
+
+    xtrace_rec* rec = &local_buf->recs[local_buf->count++];
+    rec->time = time - trace_start;
+    rec->size = size;
+    rec->id = id;
+    rec->thread = local_thread;
+    rec->op = op;
+    rec->pad = 0;
+
+    if (local_buf->count == XTRACE_BUF)
+    {
+        xtrace_flush(local_buf);
+    }
+}
+
+// The time of an xmalloc is taken once it returns and that of an xfree
+// before it starts, so a block's records sort in the order they happened
+// even when different threads made them.
+
+void*
+__wrap_xmalloc(size_t bytes)
+{
+    if (!xtrace_enabled())
+    {
+        return __real_xmalloc(bytes);
+    }
+
+    void* block = __real_xmalloc(bytes + XTRACE_PREFIX);
+    uint32_t id = atomic_fetch_add(&next_id, 1);
+    *((uint32_t*)block) = id;
+    xtrace_record(XTRACE_MALLOC, id, bytes, now_ns());
+    return block + XTRACE_PREFIX;
+}
+
+void
+__wrap_xfree(void* ptr)
+{
+    if (!xtrace_enabled())
+    {
+        __real_xfree(ptr);
+        return;
+    }
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    void* block = ptr - XTRACE_PREFIX;
+    xtrace_record(XTRACE_FREE, *((uint32_t*)block), 0, now_ns());
+    __real_xfree(block);
+}
+
+// Recorded as an xmalloc, the replayer doesn't need it zeroed.
+void*
+__wrap_xcalloc(size_t nmemb, size_t size)
+{
+    if (!xtrace_enabled())
+    {
+        return __real_xcalloc(nmemb, size);
+    }
+
+    size_t bytes;
+    if (__builtin_mul_overflow(nmemb, size, &bytes))
+    {
+        return NULL;
+    }
+
+    void* block = __real_xcalloc(1, bytes + XTRACE_PREFIX);
+    uint32_t id = atomic_fetch_add(&next_id, 1);
+    *((uint32_t*)block) = id;
+    xtrace_record(XTRACE_MALLOC, id, bytes, now_ns());
+    return block + XTRACE_PREFIX;
+}
+
+// Recorded as a plain xfree: the replayer knows the size anyway.
+void
+__wrap_xfree_sized(void* ptr, size_t size)
+{
+    if (!xtrace_enabled())
+    {
+        __real_xfree_sized(ptr, size);
+        return;
+    }
+
+    if (ptr == NULL)
+    {
+        return;
+    }
+
+    void* block = ptr - XTRACE_PREFIX;
+    xtrace_record(XTRACE_FREE, *((uint32_t*)block), 0, now_ns());
+    __real_xfree_sized(block, size + XTRACE_PREFIX);
+}
+
+void*
+__wrap_xrealloc(void* item, size_t size)
+{
+    if (!xtrace_enabled())
+    {
+        return __real_xrealloc(item, size);
+    }
+
+    if (item == NULL)
+    {
+        return __wrap_xmalloc(size);
+    }
+
+    void* block = item - XTRACE_PREFIX;
+    xtrace_record(XTRACE_REALLOC, *((uint32_t*)block), size, now_ns());
+    block = __real_xrealloc(block, size + XTRACE_PREFIX);
+    return block + XTRACE_PREFIX;
+}
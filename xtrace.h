@@ -0,0 +1,30 @@
+#ifndef XTRACE_H
+#define XTRACE_H
+
+#include <stdint.h>
+
+// Allocation traces, written by xtrace.c and read by replay_main.c.
+//
+// A trace file is XTRACE_MAGIC followed by records. Each thread buffers
+// its own records and appends them in batches, so records of different
+// threads are interleaved in no particular order; sort by time to get
+// the order things happened in.
+
+#define XTRACE_MAGIC 0x31435254584dull // "MXTRC1"
+
+enum {
+    XTRACE_MALLOC = 1,
+    XTRACE_FREE = 2,
+    XTRACE_REALLOC = 3,
+};
+
+typedef struct xtrace_rec {
+    uint64_t time;   // ns since the trace started
+    uint64_t size;   // bytes asked for, 0 for xfree
+    uint32_t id;     // block, numbered from 1 by xmalloc; xrealloc keeps it
+    uint16_t thread; // numbered from 0 in order of first call
+    uint8_t  op;
+    uint8_t  pad;
+} xtrace_rec;
+
+#endif
@@ -116,6 +116,41 @@ xmalloc(size_t nbytes)
 void*
 xrealloc(void* prev, size_t nn)
 {
-  // TODO: implement a working realloc
-  return prev + nn;
+  Header *bp;
+  size_t have;
+  void *next;
+
+  if(prev == 0)
+    return xmalloc(nn);
+
+  // the block may already be big enough
+  bp = (Header*)prev - 1;
+  have = (bp->s.size - 1) * sizeof(Header);
+  if(nn <= have)
+    return prev;
+
+  if((next = xmalloc(nn)) == 0)
+    return 0;
+  memcpy(next, prev, have);
+  xfree(prev);
+  return next;
+}
+
+void
+xfree_sized(void* ap, size_t nn)
+{
+  xfree(ap);
+}
+
+void*
+xcalloc(size_t nmemb, size_t size)
+{
+  void *ap;
+
+  if(size != 0 && nmemb > (size_t)-1 / size)
+    return 0;
+  if((ap = xmalloc(nmemb * size)) == 0)
+    return 0;
+  memset(ap, 0, nmemb * size);
+  return ap;
 }